@@ -0,0 +1,437 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+#include <fs_ext.h>
+
+/*
+ * bench - Microbenchmarks of libfs
+ *
+ * Every case runs a few warmup repetitions, then measures a number of
+ * repetitions of a fixed amount of work. The results are written as JSON, one
+ * object per case with the per-operation latency percentiles over the measured
+ * repetitions, so that runs can be compared between releases.
+ */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Default number of warmup and measured repetitions */
+#define WARMUP 3
+#define REPETITIONS 20
+
+/* Bytes moved by one repetition of the read and write cases */
+#define IO_BYTES (4 << 20)
+
+/* Most operations in one repetition of the read and write cases */
+#define IO_OPS_MAX 1024
+
+/* Data blocks of the disk used by the read, write and directory cases */
+#define DISK_BLOCKS 8192
+
+/* Transfer sizes of the read and write cases */
+static const size_t io_sizes[] = { 1, 64, 4096, 65536, 1 << 20 };
+
+/* Disk sizes of the mount cases */
+static const size_t mount_blocks[] = { 64, 1024, 8192 };
+
+/* Directory sizes of the churn cases */
+static const size_t churn_files[] = { 16, 64, FS_FILE_MAX_COUNT };
+
+static struct {
+	int warmup;
+	int reps;
+	FILE *out;
+	int first;
+	char disk[512];
+	/* Samples of the current case, in ns per operation */
+	double *samples;
+} bench = {
+	.warmup = WARMUP,
+	.reps = REPETITIONS,
+	.first = 1,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Create an empty file system of @data_blocks data blocks in @path */
+static void disk_make(const char *path, size_t data_blocks)
+{
+	size_t fat_blocks = (data_blocks * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t total = 2 + fat_blocks + data_blocks;
+	uint8_t block[BLOCK_SIZE] = { 0 };
+	uint16_t v;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+		die_perror("fopen");
+
+	/* Super block, same layout as fs.c's struct SuperBlock */
+	memcpy(block, "ECS150FS", 8);
+	v = total;
+	memcpy(block + 8, &v, 2);
+	v = fat_blocks + 1;
+	memcpy(block + 10, &v, 2);
+	v = fat_blocks + 2;
+	memcpy(block + 12, &v, 2);
+	v = data_blocks;
+	memcpy(block + 14, &v, 2);
+	block[16] = fat_blocks;
+	fwrite(block, BLOCK_SIZE, 1, f);
+
+	/* FAT, whose first entry is never a valid data block, then the rest */
+	memset(block, 0, BLOCK_SIZE);
+	block[0] = block[1] = 0xFF;
+	fwrite(block, BLOCK_SIZE, 1, f);
+	memset(block, 0, 2);
+	for (size_t i = 1; i < total - 1; i++)
+		fwrite(block, BLOCK_SIZE, 1, f);
+
+	if (fclose(f))
+		die_perror("fclose");
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile @q of the @n sorted samples */
+static double percentile(const double *s, int n, double q)
+{
+	int rank = (int)(q * n + 0.999999);
+
+	if (rank < 1)
+		rank = 1;
+	return s[rank - 1];
+}
+
+/*
+ * Report the samples of case @name. @param names the varying parameter of the
+ * case, @bytes is the amount of data one operation moves, or 0.
+ */
+static void report(const char *name, const char *param, size_t value, size_t ops, size_t bytes)
+{
+	double *s = bench.samples;
+	double mean = 0;
+	int n = bench.reps;
+
+	qsort(s, n, sizeof(double), cmp_double);
+	for (int i = 0; i < n; i++)
+		mean += s[i];
+	mean /= n;
+
+	fprintf(bench.out, "%s\n    {\"name\": \"%s\", \"%s\": %zu, \"ops\": %zu, \"unit\": \"ns/op\", "
+		"\"mean\": %.1f, \"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f",
+		bench.first ? "" : ",", name, param, value, ops,
+		mean, s[0], percentile(s, n, 0.5), percentile(s, n, 0.9), percentile(s, n, 0.99), s[n - 1]);
+	if (bytes)
+		fprintf(bench.out, ", \"mb_per_s\": %.2f", bytes / percentile(s, n, 0.5) * 1e3);
+	fprintf(bench.out, "}");
+	bench.first = 0;
+
+	fprintf(stderr, "%-12s %s=%-8zu p50 %12.1f ns/op\n", name, param, value, percentile(s, n, 0.5));
+}
+
+/*
+ * Run @fn(@arg) for the warmup and measured repetitions, each doing @ops
+ * operations, and record the time per operation of the measured ones.
+ */
+static void measure(void (*fn)(void *arg), void *arg, size_t ops)
+{
+	for (int i = 0; i < bench.warmup + bench.reps; i++) {
+		uint64_t start = now_ns();
+		fn(arg);
+		double ns = (double)(now_ns() - start) / ops;
+		if (i >= bench.warmup)
+			bench.samples[i - bench.warmup] = ns;
+	}
+}
+
+/* Parameters of the read and write cases */
+struct io {
+	int fd;
+	char *buf;
+	size_t size;
+	size_t ops;
+	size_t file_size;
+	int random;
+};
+
+static void io_write(void *arg)
+{
+	struct io *io = arg;
+
+	if (!io->random && fs_lseek(io->fd, 0))
+		die("Cannot seek");
+	for (size_t i = 0; i < io->ops; i++) {
+		if (io->random && fs_lseek(io->fd, (size_t)rand() % (io->file_size - io->size + 1)))
+			die("Cannot seek");
+		if (fs_write(io->fd, io->buf, io->size) != (int)io->size)
+			die("Cannot write");
+	}
+}
+
+static void io_read(void *arg)
+{
+	struct io *io = arg;
+
+	if (fs_lseek(io->fd, 0))
+		die("Cannot seek");
+	for (size_t i = 0; i < io->ops; i++) {
+		if (io->random) {
+			size_t offset = (size_t)rand() % (io->file_size - io->size + 1);
+			if (fs_pread(io->fd, io->buf, io->size, offset) != (int)io->size)
+				die("Cannot read");
+		} else if (fs_read(io->fd, io->buf, io->size) != (int)io->size) {
+			die("Cannot read");
+		}
+	}
+}
+
+/* Sequential and random reads and writes of every transfer size */
+static void bench_io(void)
+{
+	struct io io = { .file_size = IO_BYTES };
+	char *data;
+
+	disk_make(bench.disk, DISK_BLOCKS);
+	if (fs_mount(bench.disk))
+		die("Cannot mount disk");
+
+	data = malloc(IO_BYTES);
+	io.buf = malloc(IO_BYTES);
+	if (!data || !io.buf)
+		die_perror("malloc");
+	for (size_t i = 0; i < IO_BYTES; i++)
+		data[i] = rand();
+
+	/* File the random cases and the reads work on */
+	if (fs_create("bench") || (io.fd = fs_open("bench")) < 0)
+		die("Cannot create file");
+	if (fs_write(io.fd, data, IO_BYTES) != IO_BYTES)
+		die("Cannot write file");
+
+	for (size_t i = 0; i < ARRAY_SIZE(io_sizes); i++) {
+		io.size = io_sizes[i];
+		io.ops = IO_BYTES / io.size;
+		if (io.ops > IO_OPS_MAX)
+			io.ops = IO_OPS_MAX;
+		memcpy(io.buf, data, io.size);
+
+		io.random = 0;
+		measure(io_write, &io, io.ops);
+		report("seq_write", "size", io.size, io.ops, io.size);
+		measure(io_read, &io, io.ops);
+		report("seq_read", "size", io.size, io.ops, io.size);
+
+		io.random = 1;
+		measure(io_write, &io, io.ops);
+		report("rand_write", "size", io.size, io.ops, io.size);
+		measure(io_read, &io, io.ops);
+		report("rand_read", "size", io.size, io.ops, io.size);
+	}
+
+	fs_close(io.fd);
+	if (fs_umount())
+		die("Cannot unmount disk");
+	free(data);
+	free(io.buf);
+}
+
+/* Parameters of the churn cases */
+struct churn {
+	size_t files;
+	char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+};
+
+static void churn_run(void *arg)
+{
+	struct churn *c = arg;
+
+	for (size_t i = 0; i < c->files; i++) {
+		if (fs_create(c->names[i]))
+			die("Cannot create file");
+	}
+	for (size_t i = 0; i < c->files; i++) {
+		if (fs_delete(c->names[i]))
+			die("Cannot delete file");
+	}
+}
+
+/* Creating then deleting a growing number of files */
+static void bench_churn(void)
+{
+	struct churn c;
+
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
+		snprintf(c.names[i], FS_FILENAME_LEN, "churn%zu", i);
+
+	disk_make(bench.disk, DISK_BLOCKS);
+	if (fs_mount(bench.disk))
+		die("Cannot mount disk");
+
+	for (size_t i = 0; i < ARRAY_SIZE(churn_files); i++) {
+		c.files = churn_files[i];
+		measure(churn_run, &c, c.files);
+		report("churn", "files", c.files, c.files, 0);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount disk");
+}
+
+static void mount_run(void *arg)
+{
+	(void)arg;
+
+	if (fs_mount(bench.disk))
+		die("Cannot mount disk");
+	if (fs_umount())
+		die("Cannot unmount disk");
+}
+
+/* Mounting and unmounting disks of growing size */
+static void bench_mount(void)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(mount_blocks); i++) {
+		disk_make(bench.disk, mount_blocks[i]);
+		measure(mount_run, NULL, 1);
+		report("mount_umount", "blocks", mount_blocks[i], 1, 0);
+	}
+}
+
+static void info_run(void *arg)
+{
+	(void)arg;
+	fs_info();
+}
+
+static void ls_run(void *arg)
+{
+	(void)arg;
+	fs_ls();
+}
+
+/* fs_info() and fs_ls() on a full directory, printing to /dev/null */
+static void bench_dir(void)
+{
+	char name[FS_FILENAME_LEN];
+	int null, out;
+
+	disk_make(bench.disk, DISK_BLOCKS);
+	if (fs_mount(bench.disk))
+		die("Cannot mount disk");
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		snprintf(name, sizeof(name), "file%zu", i);
+		if (fs_create(name))
+			die("Cannot create file");
+	}
+
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	if (out < 0 || null < 0)
+		die_perror("open");
+	dup2(null, STDOUT_FILENO);
+
+	measure(info_run, NULL, 1);
+	fflush(stdout);
+	report("info", "files", FS_FILE_MAX_COUNT, 1, 0);
+	measure(ls_run, NULL, 1);
+	fflush(stdout);
+	report("ls", "files", FS_FILE_MAX_COUNT, 1, 0);
+
+	dup2(out, STDOUT_FILENO);
+	close(out);
+	close(null);
+
+	if (fs_umount())
+		die("Cannot unmount disk");
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-w <warmup>] [-r <repetitions>] [-o <output.json>]\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *tmp = getenv("TMPDIR");
+	const char *output = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:r:o:")) != -1) {
+		switch (opt) {
+		case 'w':
+			bench.warmup = atoi(optarg);
+			break;
+		case 'r':
+			bench.reps = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (bench.warmup < 0 || bench.reps < 1)
+		usage(argv[0]);
+
+	/* Own stream on stdout, which is redirected while fs_info() and fs_ls() run */
+	bench.out = output ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+	if (!bench.out)
+		die_perror("fopen");
+	bench.samples = calloc(bench.reps, sizeof(double));
+	if (!bench.samples)
+		die_perror("calloc");
+	snprintf(bench.disk, sizeof(bench.disk), "%s/bench-%d.fs", tmp ? tmp : "/tmp", (int)getpid());
+	srand(1);
+
+	fprintf(bench.out, "{\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"results\": [", bench.warmup, bench.reps);
+
+	bench_io();
+	bench_churn();
+	bench_mount();
+	bench_dir();
+
+	fprintf(bench.out, "\n  ]\n}\n");
+
+	unlink(bench.disk);
+	if (fclose(bench.out))
+		die_perror("fclose");
+	free(bench.samples);
+
+	return 0;
+}
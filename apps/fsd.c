@@ -0,0 +1,489 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_ext.h>
+#include <fsd.h>
+
+/*
+ * fsd - File system daemon
+ *
+ * Mounts a virtual disk once and serves it to any number of local processes
+ * linked with libfsclient.a, so that they share the disk, its block cache and
+ * its descriptor table instead of each mounting the image on their own. See
+ * fsd.h for the protocol.
+ */
+
+#define fsd_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fsd_error(__VA_ARGS__);		\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Maximum number of simultaneous clients */
+#define FSD_CLIENT_MAX 256
+
+/* Connected client */
+struct client {
+	/* Buffer shared with the client, NULL until hello */
+	char *shm;
+	/* Number of files the client has open */
+	size_t open_count;
+};
+
+/* Clients, indexed like their socket in the poll set (slot 0 is the listener) */
+static struct client clients[FSD_CLIENT_MAX + 1];
+static struct pollfd polls[FSD_CLIENT_MAX + 1];
+static size_t poll_count = 1;
+
+/* Client slot owning each file descriptor, 0 if not open */
+static unsigned short *fd_owner;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/*
+ * Take the descriptor passed along with message @mh, or return -1 if there is
+ * none. Any other descriptor passed is closed, so that clients cannot pile
+ * them up in the daemon.
+ */
+static int message_fd(struct msghdr *mh)
+{
+	int passed = -1;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (passed == -1) {
+				passed = fd;
+			} else {
+				close(fd);
+			}
+		}
+	}
+
+	return passed;
+}
+
+/*
+ * Receive the hello carrying the shared buffer in *@shm_fd, return -1 on
+ * failure. *@shm_fd is set to -1 once the buffer is mapped.
+ */
+static int client_hello(size_t slot, int *shm_fd)
+{
+	if (clients[slot].shm || *shm_fd == -1) {
+		return -1;
+	}
+
+	clients[slot].shm = mmap(NULL, FSD_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, *shm_fd, 0);
+	close(*shm_fd);
+	*shm_fd = -1;
+	if (clients[slot].shm == MAP_FAILED) {
+		clients[slot].shm = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Check that a request only touches the client's own descriptor and buffer.
+ * Inside a submitted batch, %FS_FD_LAST is the client's latest open.
+ */
+static int request_valid(size_t slot, struct fsd_req *req, size_t len, int submit)
+{
+	switch (req->op) {
+	case FSD_CLOSE:
+	case FSD_STAT:
+	case FSD_LSEEK:
+	case FSD_WRITE:
+	case FSD_READ:
+	case FSD_PREAD:
+	case FSD_ADVISE:
+		if (submit && req->fd == FS_FD_LAST) {
+			break;
+		}
+		if (req->fd < 0 || req->fd >= FS_OPEN_LIMIT || fd_owner[req->fd] != slot) {
+			return 0;
+		}
+		break;
+	}
+
+	if (req->shm > FSD_SHM_SIZE || len > FSD_SHM_SIZE - req->shm) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Execute one request of client @slot */
+static int64_t request_run(size_t slot, struct fsd_req *req)
+{
+	struct client *client = &clients[slot];
+	char *buf = client->shm + req->shm;
+	size_t len = 0;
+	int64_t ret;
+
+	if (client->shm == NULL) {
+		return -1;
+	}
+
+	switch (req->op) {
+	case FSD_WRITE:
+	case FSD_READ:
+	case FSD_PREAD:
+		len = req->count;
+		break;
+	case FSD_STATFS:
+		len = sizeof(struct fs_statfs);
+		break;
+	case FSD_STATS:
+		len = sizeof(struct fs_stats);
+		break;
+	case FSD_READDIR:
+		if (req->count > FSD_SHM_SIZE / sizeof(struct fs_dirent)) {
+			return -1;
+		}
+		len = req->count * sizeof(struct fs_dirent);
+		break;
+	case FSD_EXTENTS:
+		if (req->count > FSD_SHM_SIZE / sizeof(struct fs_extent)) {
+			return -1;
+		}
+		len = req->count * sizeof(struct fs_extent);
+		break;
+	}
+	if (!request_valid(slot, req, len, 0)) {
+		return -1;
+	}
+
+	/* Names are not necessarily terminated */
+	req->name[FS_FILENAME_LEN - 1] = '\0';
+
+	switch (req->op) {
+	case FSD_BYE:
+		return client->open_count ? -1 : 0;
+	case FSD_CREATE:
+		return fs_create(req->name);
+	case FSD_DELETE:
+		return fs_delete(req->name);
+	case FSD_OPEN:
+		ret = fs_open_flags(req->name, req->offset);
+		if (ret >= 0) {
+			fd_owner[ret] = slot;
+			client->open_count++;
+		}
+		return ret;
+	case FSD_CLOSE:
+		ret = fs_close(req->fd);
+		if (ret == 0) {
+			fd_owner[req->fd] = 0;
+			client->open_count--;
+		}
+		return ret;
+	case FSD_STAT:
+		return fs_stat(req->fd);
+	case FSD_LSEEK:
+		return fs_lseek(req->fd, req->offset);
+	case FSD_WRITE:
+		return fs_write(req->fd, buf, req->count);
+	case FSD_READ:
+		return fs_read(req->fd, buf, req->count);
+	case FSD_PREAD:
+		return fs_pread(req->fd, buf, req->count, req->offset);
+	case FSD_STATFS:
+		return fs_statfs((struct fs_statfs *)buf);
+	case FSD_READDIR:
+		return fs_readdir((struct fs_dirent *)buf, req->count);
+	case FSD_SYNC:
+		return fs_sync();
+	case FSD_STATS:
+		return fs_stats((struct fs_stats *)buf);
+	case FSD_EXTENTS:
+		return fs_extents(req->name, (struct fs_extent *)buf, req->count);
+	case FSD_ADVISE:
+		return fs_advise(req->fd, req->offset, req->count, req->shm);
+	}
+
+	return -1;
+}
+
+/*
+ * Execute the @count requests of @req from client @slot as one fs_submit(),
+ * filling @rsp with its result followed by the result of each request.
+ */
+static void batch_submit(size_t slot, struct fsd_req *req, size_t count, struct fsd_rsp *rsp)
+{
+	static struct fs_op ops[FSD_BATCH_MAX];
+	struct client *client = &clients[slot];
+	int last_fd = -1;
+
+	for (size_t i = 0; i <= count; i++) {
+		rsp[i].ret = -1;
+	}
+	if (client->shm == NULL) {
+		return;
+	}
+
+	// translate the requests, refusing the whole batch if one is invalid
+	for (size_t i = 0; i < count; i++) {
+		static const int op_of[] = {
+			[FSD_CREATE] = FS_OP_CREATE,
+			[FSD_DELETE] = FS_OP_DELETE,
+			[FSD_OPEN] = FS_OP_OPEN,
+			[FSD_CLOSE] = FS_OP_CLOSE,
+			[FSD_WRITE] = FS_OP_WRITE,
+			[FSD_READ] = FS_OP_READ,
+		};
+		size_t len = req[i].op == FSD_WRITE || req[i].op == FSD_READ ? req[i].count : 0;
+
+		switch (req[i].op) {
+		case FSD_CREATE:
+		case FSD_DELETE:
+		case FSD_OPEN:
+		case FSD_CLOSE:
+		case FSD_WRITE:
+		case FSD_READ:
+			break;
+		default:
+			return;
+		}
+		if (!request_valid(slot, &req[i], len, 1)) {
+			return;
+		}
+
+		req[i].name[FS_FILENAME_LEN - 1] = '\0';
+		ops[i] = (struct fs_op) {
+			.op = op_of[req[i].op],
+			.filename = req[i].name,
+			.flags = req[i].offset,
+			.fd = req[i].fd,
+			.buf = client->shm + req[i].shm,
+			.count = req[i].count,
+		};
+	}
+
+	rsp[0].ret = fs_submit(ops, count);
+
+	// account for the descriptors the batch opened and closed
+	for (size_t i = 0; i < count; i++) {
+		rsp[i + 1].ret = ops[i].result;
+		if (req[i].op == FSD_OPEN) {
+			last_fd = ops[i].result;
+			if (last_fd >= 0) {
+				fd_owner[last_fd] = slot;
+				client->open_count++;
+			}
+		} else if (req[i].op == FSD_CLOSE && ops[i].result == 0) {
+			fd_owner[req[i].fd == FS_FD_LAST ? last_fd : req[i].fd] = 0;
+			client->open_count--;
+		}
+	}
+}
+
+/* Drop client @slot, closing whatever it left open */
+static void client_drop(size_t slot)
+{
+	size_t last = poll_count - 1;
+
+	for (int fd = 0; clients[slot].open_count && fd < FS_OPEN_LIMIT; fd++) {
+		if (fd_owner[fd] == slot) {
+			fs_close(fd);
+			fd_owner[fd] = 0;
+			clients[slot].open_count--;
+		}
+	}
+
+	if (clients[slot].shm) {
+		munmap(clients[slot].shm, FSD_SHM_SIZE);
+	}
+	close(polls[slot].fd);
+
+	/* Move the last client into the hole, its descriptors follow */
+	if (slot != last) {
+		for (int fd = 0; clients[last].open_count && fd < FS_OPEN_LIMIT; fd++) {
+			if (fd_owner[fd] == last) {
+				fd_owner[fd] = slot;
+			}
+		}
+		clients[slot] = clients[last];
+		polls[slot] = polls[last];
+	}
+	memset(&clients[last], 0, sizeof(clients[last]));
+	poll_count--;
+}
+
+/* Serve one batch from client @slot, return -1 if the client must be dropped */
+static int client_serve(size_t slot)
+{
+	static struct {
+		struct fsd_batch batch;
+		struct fsd_req req[FSD_BATCH_MAX];
+	} msg;
+	static struct fsd_rsp rsp[FSD_BATCH_MAX + 1];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	ssize_t len;
+	int bye = 0;
+	int passed;
+
+	len = recvmsg(polls[slot].fd, &mh, MSG_CMSG_CLOEXEC);
+	if (len <= 0) {
+		return -1;
+	}
+	// only a hello may keep the descriptor passed along, close it otherwise
+	passed = message_fd(&mh);
+	if ((mh.msg_flags & MSG_CTRUNC)
+	    || (size_t)len < sizeof(msg.batch)
+	    || msg.batch.count > FSD_BATCH_MAX
+	    || (size_t)len != sizeof(msg.batch) + msg.batch.count * sizeof(struct fsd_req)) {
+		if (passed != -1) {
+			close(passed);
+		}
+		return -1;
+	}
+
+	if (msg.batch.flags & FSD_BATCH_SUBMIT) {
+		batch_submit(slot, msg.batch.req, msg.batch.count, rsp);
+		len = (msg.batch.count + 1) * sizeof(struct fsd_rsp);
+	} else {
+		for (size_t i = 0; i < msg.batch.count; i++) {
+			struct fsd_req *req = &msg.batch.req[i];
+
+			if (req->op == FSD_HELLO) {
+				rsp[i].ret = client_hello(slot, &passed);
+			} else {
+				rsp[i].ret = request_run(slot, req);
+				bye |= req->op == FSD_BYE && rsp[i].ret == 0;
+			}
+		}
+		len = msg.batch.count * sizeof(struct fsd_rsp);
+	}
+	if (passed != -1) {
+		close(passed);
+	}
+
+	if (send(polls[slot].fd, rsp, len, MSG_NOSIGNAL) != len || bye) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *path;
+	struct sigaction sa = { .sa_handler = on_signal };
+	int sock;
+
+	if (argc != 2 && argc != 3)
+		die("Usage: %s <diskname> [<socket>]", argv[0]);
+
+	if (argc == 3) {
+		path = argv[2];
+	} else {
+		path = getenv("FSD_SOCKET");
+	}
+	if (path) {
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	} else {
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s%s", argv[1], FSD_SOCKET_SUFFIX);
+	}
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+
+	/* All clients share one descriptor table */
+	fs_set_open_max(FS_OPEN_LIMIT);
+	fd_owner = calloc(FS_OPEN_LIMIT, sizeof(*fd_owner));
+	if (!fd_owner)
+		die_perror("calloc");
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		die_perror("socket");
+	unlink(addr.sun_path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+		die_perror("bind");
+	if (listen(sock, 64))
+		die_perror("listen");
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	polls[0].fd = sock;
+	polls[0].events = POLLIN;
+
+	while (!stop) {
+		if (poll(polls, poll_count, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("poll");
+		}
+
+		/* Serve existing clients, backwards since dropping moves the last one */
+		for (size_t slot = poll_count - 1; slot > 0; slot--) {
+			if (polls[slot].revents && client_serve(slot))
+				client_drop(slot);
+		}
+
+		if (polls[0].revents & POLLIN) {
+			int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+
+			if (client < 0)
+				continue;
+			if (poll_count > FSD_CLIENT_MAX) {
+				close(client);
+				continue;
+			}
+			polls[poll_count].fd = client;
+			polls[poll_count].events = POLLIN;
+			poll_count++;
+		}
+	}
+
+	while (poll_count > 1)
+		client_drop(poll_count - 1);
+	close(sock);
+	unlink(addr.sun_path);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
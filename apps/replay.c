@@ -0,0 +1,365 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_ext.h>
+
+/*
+ * replay - Play back calls recorded with $FS_RECORD
+ *
+ * The calls of every recorded thread are replayed in order on a thread of
+ * their own, or spread over -j threads, as fast as possible or, with -t, at the
+ * times they were originally made. Descriptors are mapped from the recorded
+ * ones to the ones the replayed opens return. Writes write a fixed pattern,
+ * since the data is not recorded. fs_info() and fs_ls() are replayed as
+ * fs_statfs() and fs_readdir(), without the printing, and the recorded mounts
+ * and checks are skipped, the disk being mounted once for the whole replay.
+ *
+ * For the results to match, the disk should be in the state it was in when
+ * the recording started, e.g. a copy of the image taken beforehand.
+ */
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Calls of one replay thread */
+struct lane {
+	pthread_t thread;
+	/* Indexes of the records to replay, in order */
+	size_t *recs;
+	size_t count;
+	size_t alloc;
+	/* Largest transfer, to size the buffer */
+	size_t max_count;
+	/* Results */
+	size_t errors;
+	size_t diverged;
+	uint64_t bytes;
+};
+
+static struct {
+	const struct fs_record *rec;
+	size_t count;
+	int timed;
+	/* Recorded descriptor to replayed one, -1 when not open */
+	int fd_map[FS_OPEN_LIMIT];
+	pthread_barrier_t barrier;
+	uint64_t start;
+} replay;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Replayed descriptor of recorded descriptor @fd */
+static int fd_lookup(int fd)
+{
+	if (fd < 0 || fd >= FS_OPEN_LIMIT)
+		return -1;
+	return __atomic_load_n(&replay.fd_map[fd], __ATOMIC_ACQUIRE);
+}
+
+static void fd_map(int fd, int live)
+{
+	if (fd >= 0 && fd < FS_OPEN_LIMIT)
+		__atomic_store_n(&replay.fd_map[fd], live, __ATOMIC_RELEASE);
+}
+
+/* Replay record @r using @buf, return the result, or 0 for a skipped call */
+static int replay_one(const struct fs_record *r, char *buf, struct fs_dirent *ents)
+{
+	struct fs_statfs st;
+	char name[FS_FILENAME_LEN + 1];
+	int fd, ret;
+
+	// an unterminated name stands for one that was too long
+	memcpy(name, r->filename, FS_FILENAME_LEN);
+	name[FS_FILENAME_LEN] = '\0';
+
+	switch (r->op) {
+	case FS_STAT_CREATE:
+		return fs_create(name);
+	case FS_STAT_DELETE:
+		return fs_delete(name);
+	case FS_STAT_OPEN:
+		ret = fs_open_flags(name, r->flags);
+		if (ret >= 0 && r->ret >= 0)
+			fd_map(r->ret, ret);
+		return ret;
+	case FS_STAT_CLOSE:
+		fd = fd_lookup(r->fd);
+		ret = fs_close(fd);
+		if (ret == 0)
+			fd_map(r->fd, -1);
+		return ret;
+	case FS_STAT_STAT:
+		return fs_stat(fd_lookup(r->fd));
+	case FS_STAT_LSEEK:
+		return fs_lseek(fd_lookup(r->fd), r->offset);
+	case FS_STAT_WRITE:
+		return fs_write(fd_lookup(r->fd), buf, r->count);
+	case FS_STAT_READ:
+		return fs_read(fd_lookup(r->fd), buf, r->count);
+	case FS_STAT_PREAD:
+		return fs_pread(fd_lookup(r->fd), buf, r->count, r->offset);
+	case FS_STAT_SYNC:
+		return fs_sync();
+	case FS_STAT_INFO:
+	case FS_STAT_STATFS:
+		return fs_statfs(&st);
+	case FS_STAT_LS:
+		return fs_readdir(ents, FS_FILE_MAX_COUNT);
+	case FS_STAT_READDIR:
+		return fs_readdir(ents, r->count < FS_FILE_MAX_COUNT ? r->count : FS_FILE_MAX_COUNT);
+	case FS_STAT_EXTENTS:
+		/* Only the number of extents is returned without room for them */
+		return fs_extents(name, NULL, 0);
+	case FS_STAT_ADVISE:
+		return fs_advise(fd_lookup(r->fd), r->offset, r->count, r->flags);
+	}
+
+	return 0;
+}
+
+static void *lane_run(void *arg)
+{
+	struct lane *lane = arg;
+	struct fs_dirent ents[FS_FILE_MAX_COUNT];
+	char *buf = malloc(lane->max_count ? lane->max_count : 1);
+
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 0x5a, lane->max_count);
+
+	pthread_barrier_wait(&replay.barrier);
+
+	for (size_t i = 0; i < lane->count; i++) {
+		const struct fs_record *r = &replay.rec[lane->recs[i]];
+
+		if (replay.timed) {
+			uint64_t at = replay.start + (r->time - replay.rec[0].time);
+			struct timespec ts = {
+				.tv_sec = at / 1000000000,
+				.tv_nsec = at % 1000000000,
+			};
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		int ret = replay_one(r, buf, ents);
+		if (ret < 0)
+			lane->errors++;
+		if ((ret < 0) != (r->ret < 0))
+			lane->diverged++;
+		if (ret > 0 && (r->op == FS_STAT_READ || r->op == FS_STAT_WRITE || r->op == FS_STAT_PREAD))
+			lane->bytes += ret;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Map the recorded trace @path */
+static void trace_load(const char *path)
+{
+	struct stat st;
+	const struct fs_record_header *header;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if ((size_t)st.st_size < sizeof(*header))
+		die("'%s' is not a recorded trace", path);
+
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (header == MAP_FAILED)
+		die_perror("mmap");
+	close(fd);
+
+	if (memcmp(header->magic, FS_RECORD_MAGIC, sizeof(header->magic)))
+		die("'%s' is not a recorded trace", path);
+	if (header->record_size != sizeof(struct fs_record))
+		die("'%s' was recorded with another record format", path);
+
+	replay.rec = (const struct fs_record *)(header + 1);
+	replay.count = (st.st_size - sizeof(*header)) / sizeof(struct fs_record);
+	if (replay.count == 0)
+		die("'%s' holds no calls", path);
+}
+
+/* Split the records among lanes, by recorded thread, at most @max lanes */
+static struct lane *lanes_build(size_t max, size_t *nlanes)
+{
+	uint32_t *tids = NULL;
+	size_t ntids = 0;
+	struct lane *lanes = NULL;
+	size_t n = 0;
+
+	for (size_t i = 0; i < replay.count; i++) {
+		const struct fs_record *r = &replay.rec[i];
+		size_t t;
+
+		for (t = 0; t < ntids && tids[t] != r->tid; t++)
+			;
+		if (t == ntids) {
+			tids = realloc(tids, (ntids + 1) * sizeof(*tids));
+			if (!tids)
+				die_perror("realloc");
+			tids[ntids++] = r->tid;
+		}
+
+		size_t l = max ? t % max : t;
+		if (l >= n) {
+			lanes = realloc(lanes, (l + 1) * sizeof(*lanes));
+			if (!lanes)
+				die_perror("realloc");
+			memset(&lanes[n], 0, (l + 1 - n) * sizeof(*lanes));
+			n = l + 1;
+		}
+
+		struct lane *lane = &lanes[l];
+		if (lane->count == lane->alloc) {
+			lane->alloc = lane->alloc ? lane->alloc * 2 : 64;
+			lane->recs = realloc(lane->recs, lane->alloc * sizeof(*lane->recs));
+			if (!lane->recs)
+				die_perror("realloc");
+		}
+		lane->recs[lane->count++] = i;
+		if ((r->op == FS_STAT_READ || r->op == FS_STAT_WRITE || r->op == FS_STAT_PREAD)
+		    && r->count > lane->max_count)
+			lane->max_count = r->count;
+	}
+
+	free(tids);
+	*nlanes = n;
+	return lanes;
+}
+
+static void report(struct lane *lanes, size_t nlanes, uint64_t elapsed)
+{
+	struct fs_stats *st = malloc(sizeof(*st));
+	size_t errors = 0, diverged = 0;
+	uint64_t bytes = 0;
+	double secs = elapsed / 1e9;
+
+	for (size_t l = 0; l < nlanes; l++) {
+		errors += lanes[l].errors;
+		diverged += lanes[l].diverged;
+		bytes += lanes[l].bytes;
+	}
+
+	printf("calls=%zu threads=%zu elapsed_s=%.6f\n", replay.count, nlanes, secs);
+	printf("calls_per_s=%.0f mb_per_s=%.2f\n", replay.count / secs, bytes / secs / (1 << 20));
+	printf("errors=%zu diverged=%zu\n", errors, diverged);
+
+	if (!st)
+		die_perror("malloc");
+	if (fs_stats(st))
+		die("Cannot get stats");
+
+	printf("%-12s %10s %10s %10s %10s\n", "op", "calls", "p50_ns", "p90_ns", "p99_ns");
+	for (int op = 0; op < FS_STAT_OP_COUNT; op++) {
+		struct fs_op_stats *o = &st->op[op];
+
+		if (!o->calls || op == FS_STAT_MOUNT)
+			continue;
+		printf("%-12s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+		       fs_stats_name(op), o->calls,
+		       fs_stats_percentile(o, 0.5),
+		       fs_stats_percentile(o, 0.9),
+		       fs_stats_percentile(o, 0.99));
+	}
+
+	free(st);
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-t] [-j threads] <diskname> <trace>\n", program);
+	fprintf(stderr, "\t-t\treplay with the recorded timing, not as fast as possible\n");
+	fprintf(stderr, "\t-j\tspread the recorded threads over that many threads\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct lane *lanes;
+	size_t nlanes, max = 0;
+	uint64_t elapsed;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "tj:")) != -1) {
+		switch (opt) {
+		case 't':
+			replay.timed = 1;
+			break;
+		case 'j':
+			max = strtoul(optarg, NULL, 0);
+			if (!max)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	trace_load(argv[optind + 1]);
+	lanes = lanes_build(max, &nlanes);
+
+	for (size_t i = 0; i < FS_OPEN_LIMIT; i++)
+		replay.fd_map[i] = -1;
+	fs_set_open_max(FS_OPEN_LIMIT);
+
+	if (fs_mount(argv[optind]))
+		die("Cannot mount diskname");
+
+	pthread_barrier_init(&replay.barrier, NULL, nlanes + 1);
+	for (size_t l = 0; l < nlanes; l++)
+		if (pthread_create(&lanes[l].thread, NULL, lane_run, &lanes[l]))
+			die("Cannot create thread");
+
+	replay.start = now_ns();
+	pthread_barrier_wait(&replay.barrier);
+	for (size_t l = 0; l < nlanes; l++)
+		pthread_join(lanes[l].thread, NULL);
+	elapsed = now_ns() - replay.start;
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	report(lanes, nlanes, elapsed);
+
+	for (size_t l = 0; l < nlanes; l++)
+		free(lanes[l].recs);
+	free(lanes);
+
+	return 0;
+}
@@ -1,18 +1,41 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
+#include <fs_ext.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Number of threads transferring host files for addmany and extract */
+#define POOL_THREADS 4
+
+/* Number of host files addmany loads ahead of the ones written to the disk */
+#define POOL_WINDOW 16
+
+/* Size of the chunks extract copies files in */
+#define EXTRACT_CHUNK (1 << 20)
+
+/* Size of each of the two buffers cat streams files through */
+#define CAT_CHUNK (256 << 10)
+
+/*
+ * Smallest file cat and extract drop from the host's cache once read. Smaller
+ * ones cannot evict much, and dropping them costs more than it saves when they
+ * are read again
+ */
+#define DROP_MIN (16 << 20)
+
 #define test_fs_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
@@ -34,239 +57,751 @@ struct thread_arg {
 	char **argv;
 };
 
-void thread_fs_script(void *arg)
+/* Commands of the script language, see scripts/README.md */
+enum {
+	SCRIPT_MOUNT,
+	SCRIPT_UMOUNT,
+	SCRIPT_CREATE,
+	SCRIPT_DELETE,
+	SCRIPT_OPEN,
+	SCRIPT_CLOSE,
+	SCRIPT_SEEK,
+	SCRIPT_WRITE,
+	SCRIPT_READ,
+	SCRIPT_REPEAT,
+	SCRIPT_END,
+	SCRIPT_TIME,
+};
+
+/* Where WRITE takes its data from, and what READ compares to */
+enum {
+	SOURCE_DATA,
+	SOURCE_FILE,
+	SOURCE_RANDOM,
+	SOURCE_DISCARD,
+};
+
+/* Limits on the descriptor names, timer names and REPEAT nesting of a script */
+#define SCRIPT_FDS 16
+#define SCRIPT_TIMERS 16
+#define SCRIPT_DEPTH 16
+
+/* Longest line of a script */
+#define SCRIPT_LINE 1024
+
+/* One command of a script */
+struct script_cmd {
+	int op;
+	int line;
+	/* SOURCE_* of WRITE and READ, 1 for TIME START */
+	int source;
+	/* Named descriptor of file commands, timer of TIME */
+	int slot;
+	/* Offset of SEEK, length of READ and WRITE RANDOM, count of REPEAT */
+	size_t len;
+	/* Index of the matching END of a REPEAT, and REPEAT of an END */
+	size_t jump;
+	/* File name, or data to write or compare to */
+	char *arg;
+	size_t data_size;
+	/* File name containing %t, replaced by the thread number */
+	int per_thread;
+};
+
+/* Host file loaded by a script, once however many commands name it */
+struct script_file {
+	char *name;
+	char *data;
+	size_t size;
+	struct script_file *next;
+};
+
+/* A script, parsed once and run any number of times */
+struct script {
+	struct script_cmd *cmd;
+	size_t count;
+	char *fd_names[SCRIPT_FDS];
+	size_t fd_count;
+	char *timer_names[SCRIPT_TIMERS];
+	size_t timer_count;
+	/* Largest buffer a READ needs */
+	size_t read_max;
+	struct script_file *files;
+};
+
+/* State of one run of a script */
+struct script_run {
+	const char *diskname;
+	/* Number of the thread running the script, in a parallel run */
+	int thread;
+	/*
+	 * Run alongside others on a disk mounted for all of them: MOUNT and UMOUNT
+	 * are skipped, success messages not printed and timers labelled with the
+	 * thread number
+	 */
+	int shared;
+	/* Set when a command failed in a shared run, which cannot exit */
+	int failed;
+	char mounted;
+	int fds[SCRIPT_FDS];
+	char *buf;
+	/* File system commands run and bytes they transferred */
+	uint64_t ops;
+	uint64_t bytes;
+	struct {
+		uint64_t start;
+		uint64_t ops;
+		uint64_t bytes;
+	} timer[SCRIPT_TIMERS];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Index of @name in @names, added if new */
+static int script_name(char **names, size_t *count, size_t max, const char *name, int line)
+{
+	size_t i;
+
+	for (i = 0; i < *count; i++)
+		if (!strcmp(names[i], name))
+			return i;
+	if (*count == max)
+		die("line %d: more than %zu names", line, max);
+	names[*count] = strdup(name);
+	if (!names[*count])
+		die_perror("strdup");
+	return (*count)++;
+}
+
+static size_t script_number(const char *arg, int line)
+{
+	char *end;
+	long long ret;
+
+	if (!arg)
+		die("line %d: missing number", line);
+	ret = strtoll(arg, &end, 0);
+	if (*arg == '\0' || *end != '\0' || ret < 0)
+		die("line %d: invalid number '%s'", line, arg);
+	return (size_t)ret;
+}
+
+/* Read host file @filename, followed by a zero byte */
+static char *script_load(const char *filename, size_t *size)
 {
-	struct thread_arg *t_arg = arg;
 	struct stat st;
-	char *diskname, *script;
-	FILE *fd_script;
-	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
-	int offset;
-	char mounted = 0;
+	char *data;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		die_perror("fopen");
+	if (fstat(fileno(f), &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
 
-	char line_buffer[1024];
-	int command_index = 1;
+	*size = st.st_size;
+	data = calloc(*size + 1, 1);
+	if (!data)
+		die_perror("calloc");
+	if (fread(data, 1, *size, f) != *size)
+		die("Cannot read host file '%s'", filename);
+	fclose(f);
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+	return data;
+}
 
-	diskname = t_arg->argv[0];
-	script = t_arg->argv[1];
+/* Data of @len random bytes */
+static char *script_random(size_t len)
+{
+	uint64_t x = 0x9e3779b97f4a7c15ULL ^ len;
+	char *data = malloc(len + 1);
+
+	if (!data)
+		die_perror("malloc");
+	for (size_t i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		data[i] = x;
+	}
+	data[len] = '\0';
 
-	/* Open script on host computer */
-	fd_script = fopen(script, "r");
-	if (!fd_script)
+	return data;
+}
+
+/* Data of host file @filename, loaded by the first command of @script naming it */
+static char *script_file(struct script *script, const char *filename, size_t *size)
+{
+	struct script_file *file;
+
+	for (file = script->files; file; file = file->next)
+		if (!strcmp(file->name, filename))
+			break;
+
+	if (!file) {
+		file = malloc(sizeof(*file));
+		if (!file)
+			die_perror("malloc");
+		file->name = strdup(filename);
+		if (!file->name)
+			die_perror("strdup");
+		file->data = script_load(filename, &file->size);
+		file->next = script->files;
+		script->files = file;
+	}
+
+	*size = file->size;
+	return file->data;
+}
+
+/* Parse the data source of @cmd of @script from @source and @desc */
+static void script_source(struct script *script, struct script_cmd *cmd,
+			  const char *source, const char *desc)
+{
+	if (!source)
+		die("line %d: missing data source", cmd->line);
+
+	if (!strcmp(source, "DATA")) {
+		cmd->source = SOURCE_DATA;
+		cmd->arg = strdup(desc ? desc : "");
+		cmd->data_size = strlen(cmd->arg);
+	} else if (!strcmp(source, "FILE")) {
+		if (!desc)
+			die("line %d: missing host file name", cmd->line);
+		cmd->source = SOURCE_FILE;
+		cmd->arg = script_file(script, desc, &cmd->data_size);
+	} else if (cmd->op == SCRIPT_WRITE && !strcmp(source, "RANDOM")) {
+		cmd->source = SOURCE_RANDOM;
+		cmd->len = script_number(desc, cmd->line);
+		cmd->arg = script_random(cmd->len);
+		cmd->data_size = cmd->len;
+	} else if (cmd->op == SCRIPT_READ && !strcmp(source, "DISCARD")) {
+		cmd->source = SOURCE_DISCARD;
+	} else {
+		die("line %d: invalid data source '%s'", cmd->line, source);
+	}
+}
+
+/*
+ * Parse script file @filename. Commands are read up to the end of the file, or
+ * to its first empty line.
+ */
+static struct script *script_parse(const char *filename)
+{
+	struct script *script = calloc(1, sizeof(*script));
+	size_t open[SCRIPT_DEPTH];
+	size_t depth = 0, alloc = 0;
+	char line_buffer[SCRIPT_LINE];
+	int line = 0;
+	FILE *f;
+
+	if (!script)
+		die_perror("calloc");
+
+	f = fopen(filename, "r");
+	if (!f)
 		die_perror("fopen");
 
-	int fs_fd = -1;
+	/* The descriptor of commands not naming one */
+	script_name(script->fd_names, &script->fd_count, SCRIPT_FDS, "", 0);
+
+	while (fgets(line_buffer, sizeof(line_buffer), f) != NULL) {
+		char *args[5] = { NULL };
+		char *save, *fd_name;
+		struct script_cmd *cmd;
+		size_t n;
+
+		line++;
 
-	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
 		/* Remove trailing newline from command line */
 		char *nl = strchr(line_buffer, '\n');
 		if (nl)
 			*nl = '\0';
 
 		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
-		command = command_args[0];
-
-		int data_fd;
-		int count, data_size;
-
-		char *read_buf;
+		args[0] = strtok_r(line_buffer, "\t", &save);
+		for (n = 1; n < ARRAY_SIZE(args) && args[n - 1]; n++)
+			args[n] = strtok_r(NULL, "\t", &save);
 
 		/* End when no command present */
-		if (!command)
+		if (!args[0])
 			break;
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
-				die("Cannot mount disk");
-			else {
-				printf("MOUNT successful.\n");
-				mounted = 1;
-			}
+		if (script->count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			script->cmd = realloc(script->cmd, alloc * sizeof(*script->cmd));
+			if (!script->cmd)
+				die_perror("realloc");
+		}
+		cmd = &script->cmd[script->count];
+		memset(cmd, 0, sizeof(*cmd));
+		cmd->line = line;
+
+		/* Position of the optional descriptor name, past the arguments */
+		fd_name = NULL;
+
+		if (!strcmp(args[0], "MOUNT")) {
+			cmd->op = SCRIPT_MOUNT;
+		} else if (!strcmp(args[0], "UMOUNT")) {
+			cmd->op = SCRIPT_UMOUNT;
+		} else if (!strcmp(args[0], "CREATE") || !strcmp(args[0], "DELETE")) {
+			cmd->op = !strcmp(args[0], "CREATE") ? SCRIPT_CREATE : SCRIPT_DELETE;
+			if (!args[1])
+				die("line %d: missing file name", line);
+			cmd->arg = strdup(args[1]);
+			cmd->per_thread = strstr(args[1], "%t") != NULL;
+		} else if (!strcmp(args[0], "OPEN")) {
+			cmd->op = SCRIPT_OPEN;
+			if (!args[1])
+				die("line %d: missing file name", line);
+			cmd->arg = strdup(args[1]);
+			cmd->per_thread = strstr(args[1], "%t") != NULL;
+			fd_name = args[2];
+		} else if (!strcmp(args[0], "CLOSE")) {
+			cmd->op = SCRIPT_CLOSE;
+			fd_name = args[1];
+		} else if (!strcmp(args[0], "SEEK")) {
+			cmd->op = SCRIPT_SEEK;
+			cmd->len = script_number(args[1], line);
+			fd_name = args[2];
+		} else if (!strcmp(args[0], "WRITE")) {
+			cmd->op = SCRIPT_WRITE;
+			script_source(script, cmd, args[1], args[2]);
+			fd_name = args[3];
+		} else if (!strcmp(args[0], "READ")) {
+			cmd->op = SCRIPT_READ;
+			cmd->len = script_number(args[1], line);
+			script_source(script, cmd, args[2], args[3]);
+			fd_name = cmd->source == SOURCE_DISCARD ? args[3] : args[4];
+			n = (cmd->len > cmd->data_size ? cmd->len : cmd->data_size) + 1;
+			if (n > script->read_max)
+				script->read_max = n;
+		} else if (!strcmp(args[0], "REPEAT")) {
+			cmd->op = SCRIPT_REPEAT;
+			cmd->len = script_number(args[1], line);
+			if (depth == SCRIPT_DEPTH)
+				die("line %d: REPEAT nested more than %d deep", line, SCRIPT_DEPTH);
+			open[depth++] = script->count;
+		} else if (!strcmp(args[0], "END")) {
+			cmd->op = SCRIPT_END;
+			if (!depth)
+				die("line %d: END without REPEAT", line);
+			cmd->jump = open[--depth];
+			script->cmd[cmd->jump].jump = script->count;
+		} else if (!strcmp(args[0], "TIME")) {
+			cmd->op = SCRIPT_TIME;
+			if (!args[1] || (strcmp(args[1], "START") && strcmp(args[1], "STOP")))
+				die("line %d: TIME needs START or STOP", line);
+			cmd->source = !strcmp(args[1], "START");
+			cmd->slot = script_name(script->timer_names, &script->timer_count,
+						SCRIPT_TIMERS, args[2] ? args[2] : "", line);
+		} else {
+			die("line %d: invalid command '%s'", line, args[0]);
+		}
 
-		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
-				die("Cannot unmount");
-			else {
-				printf("UMOUNT successful.\n");
-				mounted = 0;
-			}
+		if (fd_name)
+			cmd->slot = script_name(script->fd_names, &script->fd_count,
+						SCRIPT_FDS, fd_name, line);
+		script->count++;
+	}
+	if (depth)
+		die("line %d: REPEAT without END", script->cmd[open[depth - 1]].line);
 
-		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+	fclose(f);
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
-				die("Cannot create file");
-			}
+	return script;
+}
 
-			printf("CREATE successful.\n");
+/* File name of @cmd for @run, written to @buf if it depends on the thread */
+static const char *script_filename(const struct script_cmd *cmd, const struct script_run *run,
+				   char *buf, size_t size)
+{
+	const char *p = cmd->arg;
+	size_t n = 0;
+
+	if (!cmd->per_thread)
+		return cmd->arg;
+
+	while (*p && n < size - 1) {
+		if (p[0] == '%' && p[1] == 't') {
+			n += snprintf(buf + n, size - n, "%d", run->thread);
+			p += 2;
+		} else {
+			buf[n++] = *p++;
+		}
+	}
+	buf[n < size ? n : size - 1] = '\0';
 
-		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
+	return buf;
+}
 
-			if(fs_delete(fs_filename)) {
-				fs_umount();
-				die("Cannot delete file");
-			}
+/*
+ * Stop @run at a failed command. A run of its own unmounts the disk and exits,
+ * while a shared run is only marked failed, since other threads still use the
+ * disk: the caller unmounts it once every thread is done.
+ */
+#define script_fail(run, msg)					\
+do {								\
+	if ((run)->shared) {					\
+		test_fs_error("[%d] " msg, (run)->thread);	\
+		(run)->failed = 1;				\
+		return;						\
+	}							\
+	fs_umount();						\
+	die(msg);						\
+} while (0)
 
-			printf("DELETE successful.\n");
+/* Run @script, with the state in @run, stop at the first failed command */
+static void script_run(const struct script *script, struct script_run *run)
+{
+	char name[2 * FS_FILENAME_LEN];
+	size_t left[SCRIPT_DEPTH];
+	size_t depth = 0;
+	size_t pc = 0;
+	int count, new_fd;
+
+	while (pc < script->count) {
+		const struct script_cmd *cmd = &script->cmd[pc];
+		int *fd = &run->fds[cmd->slot];
+		/* Commands in a REPEAT do not report success */
+		int verbose = depth == 0 && !run->shared;
+
+		pc++;
+
+		switch (cmd->op) {
+		case SCRIPT_MOUNT:
+			if (run->shared)
+				break;
+			if (fs_mount(run->diskname))
+				die("Cannot mount disk");
+			run->mounted = 1;
+			if (verbose)
+				printf("MOUNT successful.\n");
+			break;
 
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
+		case SCRIPT_UMOUNT:
+			if (run->shared)
+				break;
+			if (run->mounted && fs_umount())
+				die("Cannot unmount");
+			run->mounted = 0;
+			if (verbose)
+				printf("UMOUNT successful.\n");
+			break;
 
-			fs_fd = fs_open(fs_filename);
+		case SCRIPT_CREATE:
+			run->ops++;
+			if (fs_create(script_filename(cmd, run, name, sizeof(name))))
+				script_fail(run, "Cannot create file");
+			if (verbose)
+				printf("CREATE successful.\n");
+			break;
 
-			if (fs_fd < 0) {
-				fs_umount();
-				die("Cannot open file");
-			}
+		case SCRIPT_DELETE:
+			run->ops++;
+			if (fs_delete(script_filename(cmd, run, name, sizeof(name))))
+				script_fail(run, "Cannot delete file");
+			if (verbose)
+				printf("DELETE successful.\n");
+			break;
 
-			printf("OPEN successful.\n");
+		case SCRIPT_OPEN:
+			run->ops++;
+			/* Keep the slot's descriptor if the open fails, it may still be open */
+			new_fd = fs_open(script_filename(cmd, run, name, sizeof(name)));
+			if (new_fd < 0)
+				script_fail(run, "Cannot open file");
+			*fd = new_fd;
+			if (verbose)
+				printf("OPEN successful.\n");
+			break;
 
-		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
-				fs_umount();
-				die("Cannot close file");
-			}
+		case SCRIPT_CLOSE:
+			run->ops++;
+			if (fs_close(*fd))
+				script_fail(run, "Cannot close file");
+			*fd = -1;
+			if (verbose)
+				printf("CLOSE successful.\n");
+			break;
 
-			printf("CLOSE successful.\n");
+		case SCRIPT_SEEK:
+			run->ops++;
+			if (fs_lseek(*fd, cmd->len))
+				script_fail(run, "Cannot seek to position");
+			if (verbose)
+				printf("SEEK successful.\n");
+			break;
 
-		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+		case SCRIPT_WRITE:
+			run->ops++;
+			count = fs_write(*fd, cmd->arg, cmd->data_size);
+			if (count < 0)
+				script_fail(run, "write error");
+			run->bytes += count;
+			if (verbose)
+				printf("Wrote %d bytes to file.\n", count);
+			break;
 
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
-				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
+		case SCRIPT_READ:
+			run->ops++;
+			count = fs_read(*fd, run->buf, cmd->len);
+			if (count < 0)
+				script_fail(run, "read error");
+			run->bytes += count;
+			if (cmd->source == SOURCE_DISCARD) {
+				if (verbose)
+					printf("Read %d bytes from file.\n", count);
+				break;
 			}
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
+			// data was allocated with an extra zero byte, the read data is
+			// followed by zeros too, +1 here to check for the canaries
+			memset(run->buf + count, 0, script->read_max - count);
+			if (memcmp(cmd->arg, run->buf, cmd->data_size + 1) == 0) {
+				if (verbose)
+					printf("Read %d bytes from file. Compared %zu correct.\n",
+					       count, cmd->data_size);
 			} else {
-				data = NULL;
-				data_size = 0;
+				printf("Read unexpected data! %s read vs given %s\n",
+				       run->buf, cmd->arg);
 			}
+			break;
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
+		case SCRIPT_REPEAT:
+			if (cmd->len == 0) {
+				pc = cmd->jump + 1;
+				break;
 			}
+			left[depth++] = cmd->len;
+			break;
 
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
-				fs_umount();
-				die("write error");
-			}
-			printf("Wrote %d bytes to file.\n", count);
-
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
+		case SCRIPT_END:
+			if (--left[depth - 1] > 0)
+				pc = cmd->jump + 1;
+			else
+				depth--;
+			break;
+
+		case SCRIPT_TIME:
+			if (cmd->source) {
+				run->timer[cmd->slot].start = now_ns();
+				run->timer[cmd->slot].ops = run->ops;
+				run->timer[cmd->slot].bytes = run->bytes;
 			} else {
-				fs_umount();
-				die("Invalid data description");
-			}
+				double secs = (now_ns() - run->timer[cmd->slot].start) / 1e9;
+				uint64_t ops = run->ops - run->timer[cmd->slot].ops;
+				uint64_t bytes = run->bytes - run->timer[cmd->slot].bytes;
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
+				const char *timer = script->timer_names[cmd->slot];
 
-			if (read_req_length < 0) {
-				fs_umount();
-				die("invalid data read length");
+				if (run->shared)
+					printf("[%d] ", run->thread);
+				printf("TIME%s%s: %.6f s, %" PRIu64 " ops, %.0f ops/s, %" PRIu64
+				       " bytes, %.2f MB/s\n", *timer ? " " : "", timer,
+				       secs, ops, ops / secs, bytes, bytes / secs / (1 << 20));
 			}
+			break;
+		}
+	}
+}
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+/* Prepare @run to run @script on @diskname */
+static void script_run_init(struct script_run *run, const struct script *script,
+			    const char *diskname)
+{
+	memset(run, 0, sizeof(*run));
+	run->diskname = diskname;
+	for (size_t i = 0; i < SCRIPT_FDS; i++)
+		run->fds[i] = -1;
+	run->buf = malloc(script->read_max + 1);
+	if (!run->buf)
+		die_perror("malloc");
+}
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
-			}
+void thread_fs_script(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script *script;
+	struct script_run run;
 
-			// both data and read_buf were allocated with an extra zero byte
-			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
 
-			free(read_buf);
-			if(file_loaded){
-				free(data);
-			}
-		}
-	}
+	script = script_parse(t_arg->argv[1]);
+	script_run_init(&run, script, t_arg->argv[0]);
+	script_run(script, &run);
 
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
-	if (mounted && fs_umount())
+	if (run.mounted && fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	free(run.buf);
+}
+
+/* Print the per-operation counters of @st */
+static void stats_print(const struct fs_stats *st)
+{
+	printf("%-12s %10s %8s %14s %10s %10s %10s\n", "op", "calls",
+	       "errors", "bytes", "p50_ns", "p90_ns", "p99_ns");
+	for (int op = 0; op < FS_STAT_OP_COUNT; op++) {
+		const struct fs_op_stats *o = &st->op[op];
+
+		if (!o->calls)
+			continue;
+		printf("%-12s %10" PRIu64 " %8" PRIu64 " %14" PRIu64
+		       " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+		       fs_stats_name(op), o->calls, o->errors, o->bytes,
+		       fs_stats_percentile(o, 0.5),
+		       fs_stats_percentile(o, 0.9),
+		       fs_stats_percentile(o, 0.99));
+	}
+}
+
+/* One thread of a parallel run */
+struct parallel {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	const char *filename;
+	const struct script *script;
+	struct script_run run;
+	uint64_t start;
+	uint64_t end;
+	/* Counters of the calls the thread made */
+	struct fs_stats st;
+};
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel *p = arg;
+
+	pthread_barrier_wait(p->barrier);
+	p->start = now_ns();
+	script_run(p->script, &p->run);
+	p->end = now_ns();
+
+	/* Leave nothing open that would keep the disk from being unmounted */
+	if (p->run.failed) {
+		for (size_t i = 0; i < SCRIPT_FDS; i++) {
+			if (p->run.fds[i] >= 0)
+				fs_close(p->run.fds[i]);
+		}
+	}
+
+	if (fs_stats_thread(&p->st))
+		memset(&p->st, 0, sizeof(p->st));
+
+	return NULL;
+}
+
+/*
+ * Run scripts concurrently, one per thread, on a disk mounted once for all of
+ * them. With fewer scripts than threads, the scripts are handed out in turn.
+ */
+void thread_fs_parallel(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script **scripts;
+	struct parallel *threads;
+	struct fs_stats *st;
+	pthread_barrier_t barrier;
+	uint64_t start = UINT64_MAX, end = 0, ops = 0, bytes = 0;
+	double elapsed;
+	int nthreads, nscripts, failed = 0, i;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <threads> <script filename> [<script filename>...]");
+
+	nthreads = atoi(t_arg->argv[1]);
+	nscripts = t_arg->argc - 2;
+	if (nthreads < 1)
+		die("Invalid number of threads");
+
+	scripts = malloc(nscripts * sizeof(*scripts));
+	threads = calloc(nthreads, sizeof(*threads));
+	st = malloc(sizeof(*st));
+	if (!scripts || !threads || !st)
+		die_perror("malloc");
+	for (i = 0; i < nscripts; i++)
+		scripts[i] = script_parse(t_arg->argv[2 + i]);
+
+	if (nthreads * SCRIPT_FDS > FS_OPEN_MAX_COUNT)
+		fs_set_open_max(nthreads * SCRIPT_FDS < FS_OPEN_LIMIT ?
+				nthreads * SCRIPT_FDS : FS_OPEN_LIMIT);
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		struct parallel *p = &threads[i];
+
+		p->barrier = &barrier;
+		p->filename = t_arg->argv[2 + i % nscripts];
+		p->script = scripts[i % nscripts];
+		script_run_init(&p->run, p->script, t_arg->argv[0]);
+		p->run.thread = i;
+		p->run.shared = 1;
+		if (pthread_create(&p->thread, NULL, parallel_worker, p))
+			die("Cannot create thread");
+	}
+
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("%-6s %-20s %10s %12s %12s %10s %10s %10s %10s %10s\n", "thread",
+	       "script", "ops", "elapsed_s", "ops_per_s", "mb_per_s",
+	       "read_p50", "read_p99", "write_p50", "write_p99");
+	for (i = 0; i < nthreads; i++) {
+		struct parallel *p = &threads[i];
+		double secs = (p->end - p->start) / 1e9;
+
+		printf("%-6d %-20s %10" PRIu64 " %12.6f %12.0f %10.2f %10" PRIu64
+		       " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+		       i, p->filename, p->run.ops, secs, p->run.ops / secs,
+		       p->run.bytes / secs / (1 << 20),
+		       fs_stats_percentile(&p->st.op[FS_STAT_READ], 0.5),
+		       fs_stats_percentile(&p->st.op[FS_STAT_READ], 0.99),
+		       fs_stats_percentile(&p->st.op[FS_STAT_WRITE], 0.5),
+		       fs_stats_percentile(&p->st.op[FS_STAT_WRITE], 0.99));
+		ops += p->run.ops;
+		bytes += p->run.bytes;
+		if (p->start < start)
+			start = p->start;
+		if (p->end > end)
+			end = p->end;
+		failed += p->run.failed;
+		free(p->run.buf);
+	}
+
+	/* From the first thread starting to the last one finishing */
+	elapsed = (end - start) / 1e9;
+	printf("total: %d threads, %" PRIu64 " ops in %.6f s, %.0f ops/s, %.2f MB/s\n",
+	       nthreads, ops, elapsed, ops / elapsed, bytes / elapsed / (1 << 20));
+
+	if (fs_stats(st))
+		die("Cannot get stats");
+	stats_print(st);
+
+	pthread_barrier_destroy(&barrier);
+	free(st);
+	free(threads);
+	free(scripts);
+
+	if (failed)
+		die("%d thread(s) failed", failed);
 }
 
 void thread_fs_stat(void *arg)
@@ -316,12 +851,63 @@ void thread_fs_stat(void *arg)
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
 }
 
+/* Chunk handed from the thread reading the disk to the thread writing stdout */
+struct chunk {
+	char *buf;
+	size_t size;
+	int full;
+};
+
+/* Double buffer shared by cat and its stdout writer */
+struct stream {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct chunk chunk[2];
+	int done;
+	int error;
+};
+
+/* cat stdout writer, writes chunks out in order as they are filled */
+static void *stream_writer(void *arg)
+{
+	struct stream *st = arg;
+
+	for (size_t n = 0; ; n++) {
+		struct chunk *c = &st->chunk[n % 2];
+
+		pthread_mutex_lock(&st->lock);
+		while (!c->full && !st->done)
+			pthread_cond_wait(&st->cond, &st->lock);
+		if (!c->full) {
+			pthread_mutex_unlock(&st->lock);
+			break;
+		}
+		pthread_mutex_unlock(&st->lock);
+
+		if (fwrite(c->buf, 1, c->size, stdout) != c->size)
+			st->error = 1;
+
+		pthread_mutex_lock(&st->lock);
+		c->full = 0;
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+	}
+
+	fflush(stdout);
+	return NULL;
+}
+
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	struct stream st = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t writer;
+	char *diskname, *filename;
 	int fs_fd;
-	int stat, read;
+	int stat, read = 0;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -344,19 +930,69 @@ void thread_fs_cat(void *arg)
 		die("Cannot stat file");
 	}
 	if (!stat) {
+		fs_close(fs_fd);
+		fs_umount();
 		/* Nothing to read, file is empty */
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
+
+	/* Memory use is two chunks whatever the size of the file */
+	for (int i = 0; i < 2; i++) {
+		st.chunk[i].buf = malloc(CAT_CHUNK);
+		if (!st.chunk[i].buf) {
+			perror("malloc");
+			fs_umount();
+			die("Cannot malloc");
+		}
+	}
+
+	/* The content is streamed, so the header goes out first */
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+
+	if (pthread_create(&writer, NULL, stream_writer, &st)) {
 		fs_umount();
-		die("Cannot malloc");
+		die("Cannot create writer thread");
+	}
+
+	/* The file is read once front to back: read ahead, then drop it */
+	fs_advise(fs_fd, 0, 0, FS_ADV_SEQUENTIAL);
+
+	/* Read chunk n+1 from the disk while chunk n is written to stdout */
+	for (size_t n = 0; read < stat; n++) {
+		struct chunk *c = &st.chunk[n % 2];
+		size_t want = stat - read < CAT_CHUNK ? stat - read : CAT_CHUNK;
+
+		pthread_mutex_lock(&st.lock);
+		while (c->full)
+			pthread_cond_wait(&st.cond, &st.lock);
+		pthread_mutex_unlock(&st.lock);
+
+		int got = fs_read(fs_fd, c->buf, want);
+		if (got <= 0)
+			break;
+		read += got;
+
+		pthread_mutex_lock(&st.lock);
+		c->size = got;
+		c->full = 1;
+		pthread_cond_broadcast(&st.cond);
+		pthread_mutex_unlock(&st.lock);
 	}
 
-	read = fs_read(fs_fd, buf, stat);
+	pthread_mutex_lock(&st.lock);
+	st.done = 1;
+	pthread_cond_broadcast(&st.cond);
+	pthread_mutex_unlock(&st.lock);
+	pthread_join(writer, NULL);
+
+	free(st.chunk[0].buf);
+	free(st.chunk[1].buf);
 
+	if (stat >= DROP_MIN)
+		fs_advise(fs_fd, 0, 0, FS_ADV_DONTNEED);
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
@@ -365,12 +1001,10 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
+	if (read != stat)
+		die("Read only %d/%d bytes", read, stat);
+	if (st.error)
+		die_perror("fwrite");
 }
 
 void thread_fs_rm(void *arg)
@@ -461,6 +1095,311 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+/* Host file loaded by an addmany reader */
+struct loaded {
+	char *buf;
+	ssize_t size;
+	int ready;
+};
+
+/* Work shared by the addmany readers and the thread writing to the disk */
+struct ingest {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **files;
+	size_t count;
+	/* Next file to load */
+	size_t next;
+	/* Number of files written to the disk */
+	size_t done;
+	struct loaded *loaded;
+};
+
+/* Load the whole content of host file @filename, return its size or -1 */
+static ssize_t load_file(const char *filename, char **buf)
+{
+	struct stat st;
+	ssize_t size = 0;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+
+	*buf = malloc(st.st_size ? st.st_size : 1);
+	if (!*buf) {
+		close(fd);
+		return -1;
+	}
+	while (size < st.st_size) {
+		ssize_t n = read(fd, *buf + size, st.st_size - size);
+		if (n <= 0) {
+			free(*buf);
+			close(fd);
+			return -1;
+		}
+		size += n;
+	}
+
+	close(fd);
+	return size;
+}
+
+/* addmany reader, loads host files at most POOL_WINDOW ahead of the writer */
+static void *ingest_reader(void *arg)
+{
+	struct ingest *in = arg;
+
+	pthread_mutex_lock(&in->lock);
+	for (;;) {
+		while (in->next < in->count && in->next >= in->done + POOL_WINDOW)
+			pthread_cond_wait(&in->cond, &in->lock);
+		if (in->next >= in->count)
+			break;
+		size_t i = in->next++;
+		pthread_mutex_unlock(&in->lock);
+
+		char *buf = NULL;
+		ssize_t size = load_file(in->files[i], &buf);
+
+		pthread_mutex_lock(&in->lock);
+		in->loaded[i].buf = buf;
+		in->loaded[i].size = size;
+		in->loaded[i].ready = 1;
+		pthread_cond_broadcast(&in->cond);
+	}
+	pthread_mutex_unlock(&in->lock);
+
+	return NULL;
+}
+
+void thread_fs_addmany(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct ingest in = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t readers[POOL_THREADS];
+	size_t nreaders, failed = 0;
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>...");
+
+	diskname = t_arg->argv[0];
+	in.files = &t_arg->argv[1];
+	in.count = t_arg->argc - 1;
+	in.loaded = calloc(in.count, sizeof(*in.loaded));
+	if (!in.loaded)
+		die_perror("calloc");
+
+	/* Mount once for all files, the metadata is written back at umount */
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Readers load the next host files while this thread writes to disk */
+	nreaders = in.count < POOL_THREADS ? in.count : POOL_THREADS;
+	for (size_t i = 0; i < nreaders; i++) {
+		if (pthread_create(&readers[i], NULL, ingest_reader, &in)) {
+			fs_umount();
+			die("Cannot create reader thread");
+		}
+	}
+
+	for (size_t i = 0; i < in.count; i++) {
+		char *filename = in.files[i];
+		struct loaded *l = &in.loaded[i];
+		int fs_fd, written = -1;
+
+		pthread_mutex_lock(&in.lock);
+		while (!l->ready)
+			pthread_cond_wait(&in.cond, &in.lock);
+		pthread_mutex_unlock(&in.lock);
+
+		if (l->size < 0) {
+			test_fs_error("Cannot read host file '%s'", filename);
+		} else if (fs_create(filename)) {
+			test_fs_error("Cannot create file '%s'", filename);
+		} else if ((fs_fd = fs_open(filename)) < 0) {
+			test_fs_error("Cannot open file '%s'", filename);
+		} else {
+			written = fs_write(fs_fd, l->buf, l->size);
+			fs_close(fs_fd);
+			printf("Wrote file '%s' (%d/%zd bytes)\n", filename, written, l->size);
+		}
+		if (written < 0)
+			failed++;
+
+		free(l->buf);
+		l->buf = NULL;
+
+		pthread_mutex_lock(&in.lock);
+		in.done++;
+		pthread_cond_broadcast(&in.cond);
+		pthread_mutex_unlock(&in.lock);
+	}
+
+	for (size_t i = 0; i < nreaders; i++)
+		pthread_join(readers[i], NULL);
+	free(in.loaded);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (failed)
+		die("%zu file(s) could not be added", failed);
+}
+
+/* Work shared by the extract threads */
+struct extract {
+	pthread_mutex_t lock;
+	/* Host directory the files are extracted to */
+	int dirfd;
+	struct fs_dirent *ents;
+	size_t count;
+	/* Next file to extract */
+	size_t next;
+	/* Bytes extracted from each file, -1 on failure */
+	ssize_t *result;
+};
+
+/*
+ * Copy file @ent of the disk to a new file of directory @dirfd, return its size
+ * or -1. Names come from the disk, so those that could leave the directory are
+ * refused, and existing files and symbolic links are never written through.
+ */
+static ssize_t extract_file(int dirfd, struct fs_dirent *ent, char *buf)
+{
+	const char *name = ent->filename;
+	size_t offset = 0;
+	int fs_fd, fd;
+
+	if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, ".."))
+		return -1;
+
+	fs_fd = fs_open(name);
+	if (fs_fd < 0)
+		return -1;
+	fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+	if (fd < 0) {
+		fs_close(fs_fd);
+		return -1;
+	}
+	fs_advise(fs_fd, 0, 0, FS_ADV_SEQUENTIAL);
+
+	/* Read the next chunk from the disk as soon as the last one is written out */
+	while (offset < ent->size) {
+		int n = fs_pread(fs_fd, buf, EXTRACT_CHUNK, offset);
+		if (n <= 0)
+			break;
+		for (ssize_t done = 0; done < n; ) {
+			ssize_t w = write(fd, buf + done, n - done);
+			if (w < 0) {
+				n = -1;
+				break;
+			}
+			done += w;
+		}
+		if (n < 0)
+			break;
+		offset += n;
+	}
+
+	/* Every file is only read once, keep the host's cache for the rest */
+	if (ent->size >= DROP_MIN)
+		fs_advise(fs_fd, 0, 0, FS_ADV_DONTNEED);
+	fs_close(fs_fd);
+	if (close(fd) || offset != ent->size)
+		return -1;
+
+	return offset;
+}
+
+static void *extract_worker(void *arg)
+{
+	struct extract *ex = arg;
+	char *buf = malloc(EXTRACT_CHUNK);
+
+	for (;;) {
+		pthread_mutex_lock(&ex->lock);
+		size_t i = ex->next++;
+		pthread_mutex_unlock(&ex->lock);
+		if (i >= ex->count)
+			break;
+
+		ex->result[i] = buf ? extract_file(ex->dirfd, &ex->ents[i], buf) : -1;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+void thread_fs_extract(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent ents[FS_FILE_MAX_COUNT];
+	ssize_t result[FS_FILE_MAX_COUNT];
+	struct extract ex = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.ents = ents,
+		.result = result,
+	};
+	pthread_t workers[POOL_THREADS];
+	size_t nworkers, failed = 0;
+	char *diskname;
+	int count;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory>");
+
+	diskname = t_arg->argv[0];
+	ex.dirfd = open(t_arg->argv[1], O_RDONLY | O_DIRECTORY);
+	if (ex.dirfd < 0)
+		die_perror("open");
+
+	/* Nothing is written to the disk, and reads can run in parallel */
+	if (fs_mount_ro(diskname))
+		die("Cannot mount diskname");
+
+	count = fs_readdir(ents, FS_FILE_MAX_COUNT);
+	if (count < 0) {
+		fs_umount();
+		die("Cannot list files");
+	}
+	ex.count = count;
+
+	nworkers = ex.count < POOL_THREADS ? ex.count : POOL_THREADS;
+	for (size_t i = 0; i < nworkers; i++) {
+		if (pthread_create(&workers[i], NULL, extract_worker, &ex)) {
+			fs_umount();
+			die("Cannot create worker thread");
+		}
+	}
+	for (size_t i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	close(ex.dirfd);
+
+	for (size_t i = 0; i < ex.count; i++) {
+		if (result[i] < 0) {
+			test_fs_error("Cannot extract file '%s'", ents[i].filename);
+			failed++;
+		} else {
+			printf("Extracted file '%s' (%zd bytes)\n", ents[i].filename, result[i]);
+		}
+	}
+
+	if (failed)
+		die("%zu file(s) could not be extracted", failed);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -499,6 +1438,201 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+/* Width of the occupancy map of fsstat, in cells */
+#define FSSTAT_WIDTH 64
+/* Rows of the occupancy map of fsstat, at most */
+#define FSSTAT_ROWS 16
+
+/* Owner of a data block in fsstat, besides the index of a file */
+#define OWNER_FREE -1
+#define OWNER_RESERVED -2
+
+/* Print the occupancy map of @owner, @count data blocks */
+static void fsstat_map(const int *owner, size_t count)
+{
+	static const char shade[] = " .:oO#";
+	size_t cells = FSSTAT_WIDTH * FSSTAT_ROWS;
+	size_t per_cell = (count + cells - 1) / cells;
+
+	printf("occupancy: %zu blocks per cell, ' ' free, '.' ':' 'o' 'O' partly used, '#' full\n",
+	       per_cell);
+	for (size_t first = 0; first < count; first += per_cell * FSSTAT_WIDTH) {
+		putchar('|');
+		for (size_t c = first; c < first + per_cell * FSSTAT_WIDTH && c < count; c += per_cell) {
+			size_t n = 0, used = 0;
+
+			for (size_t b = c; b < c + per_cell && b < count; b++, n++)
+				if (owner[b] != OWNER_FREE)
+					used++;
+			// full and empty cells get their own shades, the rest is split in quarters
+			if (used == n)
+				putchar(shade[5]);
+			else if (used == 0)
+				putchar(shade[0]);
+			else
+				putchar(shade[1 + used * 4 / n]);
+		}
+		printf("|\n");
+	}
+}
+
+/*
+ * Report the layout of every file and of the free space, or with "csv", print
+ * the owner of every data block as block,file,extent lines
+ */
+void thread_fs_fsstat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent ents[FS_FILE_MAX_COUNT];
+	struct fs_statfs st;
+	struct fs_extent *ext;
+	int *owner, *extent;
+	size_t runs[17] = { 0 };
+	size_t total_blocks = 0, total_extents = 0, fragmented = 0;
+	size_t free_blocks = 0, free_runs = 0, largest = 0;
+	int csv = 0, count;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [csv]");
+	if (t_arg->argc > 1) {
+		if (strcmp(t_arg->argv[1], "csv"))
+			die("Usage: <diskname> [csv]");
+		csv = 1;
+	}
+
+	if (fs_mount_ro(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	if (fs_statfs(&st))
+		die("Cannot get file system information");
+	count = fs_readdir(ents, FS_FILE_MAX_COUNT);
+	if (count < 0)
+		die("Cannot read directory");
+
+	ext = malloc(st.data_blk_count * sizeof(*ext));
+	owner = malloc(st.data_blk_count * sizeof(*owner));
+	extent = malloc(st.data_blk_count * sizeof(*extent));
+	if (!ext || !owner || !extent)
+		die_perror("malloc");
+	for (size_t b = 0; b < st.data_blk_count; b++)
+		owner[b] = OWNER_FREE;
+	// the first entry of the FAT is never a data block
+	owner[0] = OWNER_RESERVED;
+
+	if (!csv)
+		printf("FS Stat:\n");
+	for (int i = 0; i < count; i++) {
+		int n = fs_extents(ents[i].filename, ext, st.data_blk_count);
+		size_t blocks = 0;
+
+		if (n < 0)
+			die("Cannot get extents of '%s'", ents[i].filename);
+		for (int e = 0; e < n; e++) {
+			for (size_t b = ext[e].start; b < ext[e].start + ext[e].count; b++) {
+				owner[b] = i;
+				extent[b] = e;
+			}
+			blocks += ext[e].count;
+		}
+		total_blocks += blocks;
+		total_extents += n;
+		if (n > 1)
+			fragmented++;
+		if (!csv)
+			printf("file: %s, size: %zu, blocks: %zu, extents: %d, avg_run: %.1f\n",
+			       ents[i].filename, ents[i].size, blocks, n,
+			       n ? (double)blocks / n : 0.0);
+	}
+
+	if (csv) {
+		printf("block,file,extent\n");
+		for (size_t b = 0; b < st.data_blk_count; b++) {
+			if (owner[b] >= 0)
+				printf("%zu,%s,%d\n", b, ents[owner[b]].filename, extent[b]);
+			else
+				printf("%zu,%s,\n", b, owner[b] == OWNER_FREE ? "" : "(reserved)");
+		}
+		goto out;
+	}
+
+	// runs of free blocks, bucketed by the power of two below their length
+	for (size_t b = 0; b < st.data_blk_count;) {
+		size_t len = 0;
+
+		while (b + len < st.data_blk_count && owner[b + len] == OWNER_FREE)
+			len++;
+		if (len == 0) {
+			b++;
+			continue;
+		}
+		runs[63 - __builtin_clzll(len)]++;
+		free_runs++;
+		free_blocks += len;
+		if (len > largest)
+			largest = len;
+		b += len;
+	}
+
+	printf("files=%d blocks=%zu extents=%zu avg_run=%.1f fragmented_files=%zu\n",
+	       count, total_blocks, total_extents,
+	       total_extents ? (double)total_blocks / total_extents : 0.0, fragmented);
+	printf("free_blocks=%zu free_runs=%zu largest_free_run=%zu avg_free_run=%.1f\n",
+	       free_blocks, free_runs, largest,
+	       free_runs ? (double)free_blocks / free_runs : 0.0);
+	printf("free run sizes:\n");
+	for (size_t r = 0; r < ARRAY_SIZE(runs); r++)
+		if (runs[r])
+			printf("  %zu-%zu: %zu\n", (size_t)1 << r, ((size_t)2 << r) - 1, runs[r]);
+	fsstat_map(owner, st.data_blk_count);
+
+out:
+	free(ext);
+	free(owner);
+	free(extent);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Check a disk, repairing it with "repair", even if clean with "force" */
+void thread_fs_check(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_check_report r;
+	int flags = 0;
+	int problems;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [repair] [force]");
+	for (int i = 1; i < t_arg->argc; i++) {
+		if (!strcmp(t_arg->argv[i], "repair"))
+			flags |= FS_CHECK_REPAIR;
+		else if (!strcmp(t_arg->argv[i], "force"))
+			flags |= FS_CHECK_FORCE;
+		else
+			die("Usage: <diskname> [repair] [force]");
+	}
+
+	problems = fs_check(t_arg->argv[0], flags, &r);
+	if (problems < 0)
+		die("Cannot check diskname");
+
+	printf("FS Check:\n");
+	if (r.skipped) {
+		printf("clean, not checked\n");
+		return;
+	}
+	printf("files=%u\n", r.files);
+	printf("bad_chains=%u\n", r.bad_chains);
+	printf("cross_links=%u\n", r.cross_links);
+	printf("size_mismatches=%u\n", r.size_mismatches);
+	printf("leaked_blocks=%u\n", r.leaked_blocks);
+	printf("repaired=%u\n", r.repaired);
+
+	// like fsck, fail on problems that are left
+	if (problems && !(flags & FS_CHECK_REPAIR))
+		exit(1);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -507,6 +1641,8 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_stats(void *arg);
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -514,12 +1650,72 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "addmany",	thread_fs_addmany },
+	{ "extract",	thread_fs_extract },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "parallel",	thread_fs_parallel },
+	{ "fsstat",	thread_fs_fsstat },
+	{ "check",	thread_fs_check },
+	{ "stats",	thread_fs_stats }
 };
 
+/* Run command @cmd, return 0 if there is no such command */
+int run_command(const char *cmd, struct thread_arg *arg)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(arg);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Run another command, then print the library's counters */
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	struct fs_stats *st;
+
+	if (t_arg->argc < 1)
+		die("Usage: <command> [<arg>]");
+
+	cmd_arg.argc = t_arg->argc - 1;
+	cmd_arg.argv = &t_arg->argv[1];
+	if (!run_command(t_arg->argv[0], &cmd_arg))
+		die("invalid command '%s'", t_arg->argv[0]);
+
+	st = malloc(sizeof(*st));
+	if (!st)
+		die_perror("malloc");
+	if (fs_stats(st))
+		die("Cannot get stats");
+
+	stats_print(st);
+	printf("cache_hits=%" PRIu64 "\n", st->cache_hits);
+	printf("cache_misses=%" PRIu64 "\n", st->cache_misses);
+	printf("cache_evictions=%" PRIu64 "\n", st->cache_evictions);
+	printf("cache_prefetched=%" PRIu64 "\n", st->cache_prefetched);
+	printf("blocks_allocated=%" PRIu64 "\n", st->blocks_allocated);
+	printf("blocks_freed=%" PRIu64 "\n", st->blocks_freed);
+	printf("fat_entries_scanned=%" PRIu64 "\n", st->fat_entries_scanned);
+	printf("rmw_cycles=%" PRIu64 "\n", st->rmw_cycles);
+	printf("rmw_avoided=%" PRIu64 "\n", st->rmw_avoided);
+	printf("emu_seeks=%" PRIu64 "\n", st->emu_seeks);
+	printf("emu_seek_blocks=%" PRIu64 "\n", st->emu_seek_blocks);
+	printf("emu_bytes_read=%" PRIu64 "\n", st->emu_bytes_read);
+	printf("emu_bytes_written=%" PRIu64 "\n", st->emu_bytes_written);
+	printf("emu_busy_ns=%" PRIu64 "\n", st->emu_busy_ns);
+
+	free(st);
+}
+
 void usage(char *program)
 {
 	size_t i;
@@ -532,7 +1728,6 @@ void usage(char *program)
 
 int main(int argc, char **argv)
 {
-	size_t i;
 	char *program;
 	char *cmd;
 	struct thread_arg arg;
@@ -550,13 +1745,7 @@ int main(int argc, char **argv)
 	arg.argc = --argc;
 	arg.argv = &argv[1];
 
-	for (i = 0; i < ARRAY_SIZE(commands); i++) {
-		if (!strcmp(cmd, commands[i].name)) {
-			commands[i].func(&arg);
-			break;
-		}
-	}
-	if (i == ARRAY_SIZE(commands)) {
+	if (!run_command(cmd, &arg)) {
 		test_fs_error("invalid command '%s'", cmd);
 		usage(program);
 	}
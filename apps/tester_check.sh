@@ -0,0 +1,245 @@
+#!/bin/bash
+
+set -o pipefail
+#set -xv # debug
+
+#
+# Check that test_fs.x check finds and repairs a corrupted image
+#
+# An image made by fs_make.x gets three files, then its FAT is corrupted by
+# hand with a cross-link and a leaked block. fs_mount() must refuse it and
+# check must fail on it, check repair must fix it without changing what ls
+# shows, and the state byte of the superblock must follow mounts and umounts.
+# The exit status is 1 if any test failed.
+#
+
+#
+# Logging helpers
+#
+log() {
+    echo -e "${*}"
+}
+
+inf() {
+    log "Info: ${*}"
+}
+error() {
+    log "Error: ${*}"
+}
+die() {
+    error "${*}"
+    exit 1
+}
+
+FAILED=0
+
+pass() {
+    log "Pass: ${1}"
+}
+
+fail() {
+    log "Fail: ${1}"
+    FAILED=1
+}
+
+#
+# Image helpers, offsets follow the on-disk format of libfs/fs.c
+#
+BLOCK=4096
+STATE_OFFSET=17
+STATE_UNKNOWN=0
+STATE_CLEAN=1
+STATE_DIRTY=2
+
+# Print the unsigned @3 byte little-endian integer at byte @2 of file @1
+get_uint() {
+    od -An -tu"${3}" -j "${2}" -N "${3}" --endian=little "${1}" | tr -d ' '
+}
+
+# Write @3 as a 16-bit little-endian integer at byte @2 of file @1
+put_u16() {
+    printf "$(printf '\\%03o\\%03o' $(( ${3} & 0xff )) $(( ${3} >> 8 )))" |
+        dd of="${1}" bs=1 seek="${2}" conv=notrunc status=none
+}
+
+# Write @3 as a byte at byte @2 of file @1
+put_u8() {
+    printf "$(printf '\\%03o' "${3}")" |
+        dd of="${1}" bs=1 seek="${2}" conv=notrunc status=none
+}
+
+# Print FAT entry @2 of image @1
+fat_get() {
+    get_uint "${1}" $(( BLOCK + 2 * ${2} )) 2
+}
+
+# Set FAT entry @2 of image @1 to @3
+fat_set() {
+    put_u16 "${1}" $(( BLOCK + 2 * ${2} )) "${3}"
+}
+
+# Print the data blocks of the file of root directory entry @2 of image @1
+chain() {
+    local root block
+    root=$(get_uint "${1}" 10 2)
+    block=$(get_uint "${1}" $(( root * BLOCK + 32 * ${2} + 20 )) 2)
+    while [[ ${block} -ne 65535 ]]; do
+        echo "${block}"
+        block=$(fat_get "${1}" "${block}")
+    done
+}
+
+state() {
+    get_uint "${1}" "${STATE_OFFSET}" 1
+}
+
+# Check that the state byte of image @1 is @2, when @3
+expect_state() {
+    local s
+    s=$(state "${1}")
+    if [[ ${s} -eq ${2} ]]; then
+        pass "state ${s} ${3}"
+    else
+        fail "state ${s} ${3}, expected ${2}"
+    fi
+}
+
+# Check that report @1 of check has the problem counts @2...
+expect_report() {
+    local report="${1}"
+    shift
+    local want
+    for want in "${@}"; do
+        if ! grep -qx "${want}" <<< "${report}"; then
+            fail "check reported $(grep -v ':' <<< "${report}" | tr '\n' ' ')instead of ${want}"
+            return 1
+        fi
+    done
+    return 0
+}
+
+#
+# Tests
+#
+run_tests() {
+    local img="${WORK}/disk.fs"
+    local out
+
+    "${BIN}/fs_make.x" "${img}" 100 >/dev/null || die "Cannot create an image"
+    expect_state "${img}" "${STATE_UNKNOWN}" "after fs_make.x"
+
+    # three files, of three, three and one blocks
+    head -c $(( 3 * BLOCK )) /dev/urandom > "${WORK}/f1"
+    head -c $(( 3 * BLOCK - 100 )) /dev/urandom > "${WORK}/f2"
+    head -c 100 /dev/urandom > "${WORK}/f3"
+    local f
+    for f in f1 f2 f3; do
+        (cd "${WORK}" && "${APPS}/test_fs.x" add disk.fs "${f}" >/dev/null) ||
+            die "Cannot add ${f}"
+    done
+    expect_state "${img}" "${STATE_CLEAN}" "after umount"
+
+    ./test_fs.x ls "${img}" > "${WORK}/ls.before" || die "Cannot list the image"
+
+    # mounted for writing, the image is dirty until it is unmounted
+    ./fsd.x "${img}" "${WORK}/sock" >/dev/null 2>&1 &
+    local fsd=$!
+    local i=0
+    while [[ ! -S ${WORK}/sock && ${i} -lt 50 ]]; do
+        sleep 0.1
+        i=$(( i + 1 ))
+    done
+    [[ -S ${WORK}/sock ]] || die "fsd.x did not start"
+    expect_state "${img}" "${STATE_DIRTY}" "while mounted"
+    kill -TERM "${fsd}"
+    wait "${fsd}"
+    expect_state "${img}" "${STATE_CLEAN}" "after fsd.x umount"
+
+    # the tail of f2 runs into the last block of f1, and a block no chain reaches is allocated
+    local f1 f2 ndata
+    f1=($(chain "${img}" 0))
+    f2=($(chain "${img}" 1))
+    ndata=$(get_uint "${img}" 14 2)
+    [[ ${#f1[@]} -eq 3 && ${#f2[@]} -eq 3 ]] || die "Unexpected layout of the image"
+    fat_set "${img}" "${f2[2]}" "${f1[2]}"
+    fat_set "${img}" $(( ndata - 1 )) 65535
+    put_u8 "${img}" "${STATE_OFFSET}" "${STATE_DIRTY}"
+
+    if ./test_fs.x ls "${img}" >/dev/null 2>&1; then
+        fail "corrupted image mounted"
+    else
+        pass "corrupted image refused by fs_mount()"
+    fi
+    expect_state "${img}" "${STATE_DIRTY}" "after a refused mount"
+
+    out=$(./test_fs.x check "${img}" 2>&1)
+    if [[ $? -eq 1 ]]; then
+        pass "check exits 1 on the corrupted image"
+    else
+        fail "check does not exit 1 on the corrupted image"
+    fi
+    expect_report "${out}" "files=3" "bad_chains=0" "cross_links=1" "leaked_blocks=1" &&
+        pass "check finds the cross-link and the leaked block"
+    expect_state "${img}" "${STATE_DIRTY}" "after check without repair"
+
+    out=$(./test_fs.x check "${img}" repair 2>&1) || fail "check repair failed"
+    expect_report "${out}" "cross_links=1" "leaked_blocks=1" "repaired=2" &&
+        pass "check repair fixes both problems"
+    expect_state "${img}" "${STATE_CLEAN}" "after check repair"
+
+    out=$(./test_fs.x check "${img}" force 2>&1) || fail "check force fails after repair"
+    expect_report "${out}" "files=3" "bad_chains=0" "cross_links=0" \
+        "size_mismatches=0" "leaked_blocks=0" "repaired=0" &&
+        pass "check force finds no problem after repair"
+
+    ./test_fs.x ls "${img}" > "${WORK}/ls.after" 2>&1 || fail "repaired image not mounted"
+    if cmp -s "${WORK}/ls.before" "${WORK}/ls.after"; then
+        pass "ls unchanged by the repair"
+    else
+        fail "ls changed by the repair"
+        diff -u "${WORK}/ls.before" "${WORK}/ls.after"
+    fi
+
+    # a clean image is only checked when forced
+    out=$(./test_fs.x check "${img}" 2>&1)
+    if grep -qx "clean, not checked" <<< "${out}"; then
+        pass "clean image not checked"
+    else
+        fail "clean image checked"
+    fi
+}
+
+make_fs() {
+    # Compile
+    make > /dev/null 2>&1 ||
+        die "Compilation failed"
+
+    local execs=("test_fs.x" "fsd.x")
+    local prebuilt=("fs_make.x")
+
+    # Make sure executables were properly created
+    local x
+    for x in "${execs[@]}"; do
+        if [[ ! -x "${x}" ]]; then
+            die "Can't find executable ${x}"
+        fi
+    done
+
+    # The prebuilt programs may come without their executable bit, run
+    # copies that have it
+    mkdir -p "${BIN}"
+    for x in "${prebuilt[@]}"; do
+        install -m 755 "${x}" "${BIN}/${x}" ||
+            die "Can't find ${x}"
+    done
+}
+
+APPS=$(pwd)
+WORK=$(mktemp -d)
+BIN="${WORK}/bin"
+trap 'rm -rf "${WORK}"' EXIT
+
+make_fs
+run_tests
+
+exit ${FAILED}
@@ -0,0 +1,199 @@
+#!/bin/bash
+
+set -o pipefail
+#set -xv # debug
+
+#
+# Compare the speed of test_fs.x against the fs_ref.x reference
+#
+# Every workload is timed PERF_REPS times with each program, alternating between
+# them, on images of each size in PERF_SIZES (data blocks). Each timing is the
+# mean of PERF_LOOPS runs, so that one slow process start does not decide it.
+# The medians are compared, and a workload fails when test_fs.x is slower than
+# fs_ref.x by more than PERF_MARGIN percent plus PERF_SLACK microseconds: most
+# workloads take about a millisecond, mostly process start-up, which jitters by
+# a few hundred microseconds from one run to the next. The exit status is 1 if
+# any workload failed.
+#
+PERF_REPS=${PERF_REPS:-5}
+PERF_LOOPS=${PERF_LOOPS:-10}
+PERF_SIZES=${PERF_SIZES:-"100 1000 8192"}
+PERF_MARGIN=${PERF_MARGIN:-10}
+PERF_SLACK=${PERF_SLACK:-300}
+
+#
+# Logging helpers
+#
+log() {
+    echo -e "${*}"
+}
+
+inf() {
+    log "Info: ${*}"
+}
+error() {
+    log "Error: ${*}"
+}
+die() {
+    error "${*}"
+    exit 1
+}
+
+FAILED=0
+
+pass() {
+    log "Pass: ${1}"
+}
+
+fail() {
+    log "Fail: ${1}"
+    FAILED=1
+}
+
+#
+# Timing helpers
+#
+
+# Print the time a run of command @1... takes, in microseconds, averaged over
+# PERF_LOOPS runs. The image is reset before each run when PREPARE is set,
+# untimed. The clock is read from EPOCHREALTIME, in place of date, which would
+# start a process of its own
+time_us() {
+    local start end total=0 i
+
+    for ((i = 0; i < PERF_LOOPS; i++)); do
+        [[ -n ${PREPARE} ]] && reset_image
+        start=${EPOCHREALTIME/[.,]/}
+        "${@}" >/dev/null 2>&1 || { echo "-1"; return; }
+        end=${EPOCHREALTIME/[.,]/}
+        total=$(( total + end - start ))
+    done
+    echo $(( total / PERF_LOOPS ))
+}
+
+# Print the median of the arguments
+median() {
+    printf "%s\n" "${@}" | sort -n | sed -n "$(( ($# + 1) / 2 ))p"
+}
+
+# Reset the working image to the prepared one, untimed
+reset_image() {
+    cp "${WORK}/base.fs" "${WORK}/run.fs"
+}
+
+#
+# Run workload @1, the command and arguments @2..., with both programs, PERF_REPS times each,
+# resetting the image before every run if PREPARE is set, then compare the medians
+#
+compare() {
+    local name="${1}"
+    shift
+    local ref_times=() lib_times=()
+    local i t
+
+    for ((i = 0; i < PERF_REPS; i++)); do
+        t=$(time_us "${BIN}/fs_ref.x" "${@}")
+        [[ ${t} -lt 0 ]] && { fail "${name}: fs_ref.x failed"; return; }
+        ref_times+=("${t}")
+
+        t=$(time_us "${APPS}/test_fs.x" "${@}")
+        [[ ${t} -lt 0 ]] && { fail "${name}: test_fs.x failed"; return; }
+        lib_times+=("${t}")
+    done
+
+    local ref lib
+    ref=$(median "${ref_times[@]}")
+    lib=$(median "${lib_times[@]}")
+
+    local msg
+    msg=$(awk -v n="${name}" -v r="${ref}" -v l="${lib}" 'BEGIN {
+        printf "%s: ref %.3f ms, lib %.3f ms, speedup %.2fx", n, r / 1e3, l / 1e3, r / l }')
+
+    if awk -v r="${ref}" -v l="${lib}" -v m="${PERF_MARGIN}" -v s="${PERF_SLACK}" \
+        'BEGIN { exit !(l <= r * (1 + m / 100) + s) }'; then
+        pass "${msg}"
+    else
+        fail "${msg} (more than ${PERF_MARGIN}% + ${PERF_SLACK} us slower)"
+    fi
+}
+
+#
+# Workloads, on an image of @1 data blocks
+#
+run_size() {
+    local blocks="${1}"
+    local size=$(( blocks * 4096 / 2 ))
+
+    log "\n--- ${blocks} data blocks ---"
+
+    # Host file filling half of the disk, and a script rewriting and reading
+    # it back in 4 KiB pieces
+    head -c "${size}" /dev/urandom > "${WORK}/data"
+    head -c 4096 /dev/urandom > "${WORK}/piece"
+    {
+        echo "MOUNT"
+        echo -e "OPEN\tdata"
+        for ((i = 0; i < size / 4096 && i < 256; i++)); do
+            echo -e "SEEK\t$((i * 4096))"
+            echo -e "WRITE\tFILE\t${WORK}/piece"
+            echo -e "SEEK\t$((i * 4096))"
+            echo -e "READ\t4096\tFILE\t${WORK}/piece"
+        done
+        echo "CLOSE"
+        echo "UMOUNT"
+    } > "${WORK}/rw.script"
+
+    "${BIN}/fs_make.x" "${WORK}/base.fs" "${blocks}" >/dev/null ||
+        die "Cannot create a ${blocks} block image"
+
+    # cd so that the file is named "data" on the disk
+    pushd "${WORK}" >/dev/null
+    PREPARE=1 compare "add ${blocks}" add run.fs data
+    popd >/dev/null
+
+    (cd "${WORK}" && "${BIN}/fs_ref.x" add base.fs data >/dev/null) ||
+        die "Cannot add file to the ${blocks} block image"
+    reset_image
+
+    PREPARE= compare "cat ${blocks}" cat "${WORK}/run.fs" data
+    PREPARE=1 compare "script ${blocks}" script "${WORK}/run.fs" "${WORK}/rw.script"
+    PREPARE= compare "info ${blocks}" info "${WORK}/run.fs"
+}
+
+make_fs() {
+    # Compile
+    make > /dev/null 2>&1 ||
+        die "Compilation failed"
+
+    local execs=("test_fs.x")
+    local prebuilt=("fs_make.x" "fs_ref.x")
+
+    # Make sure executables were properly created
+    local x
+    for x in "${execs[@]}"; do
+        if [[ ! -x "${x}" ]]; then
+            die "Can't find executable ${x}"
+        fi
+    done
+
+    # The prebuilt programs may come without their executable bit, run
+    # copies that have it
+    mkdir -p "${BIN}"
+    for x in "${prebuilt[@]}"; do
+        install -m 755 "${x}" "${BIN}/${x}" ||
+            die "Can't find ${x}"
+    done
+}
+
+APPS=$(pwd)
+WORK=$(mktemp -d)
+BIN="${WORK}/bin"
+trap 'rm -rf "${WORK}"' EXIT
+
+make_fs
+inf "${PERF_REPS} x ${PERF_LOOPS} runs, margin ${PERF_MARGIN}% + ${PERF_SLACK} us"
+for blocks in ${PERF_SIZES}; do
+    run_size "${blocks}"
+done
+
+exit ${FAILED}
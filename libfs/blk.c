@@ -0,0 +1,754 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "blk.h"
+#include "disk.h"
+#include "emu.h"
+#include "probe.h"
+#include "stats.h"
+
+#define blk_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Invalid file descriptor */
+#define INVALID_FD -1
+
+/* Cached blocks per set */
+#define CACHE_WAYS 8
+
+/* Default number of cached blocks, overridden by $FS_CACHE_BLOCKS */
+#define CACHE_BLOCKS 1024
+
+/* Tag of an empty cache way */
+#define NO_BLOCK SIZE_MAX
+
+/* Magic number opening a hints file, see blk_hints_save() */
+#define HINTS_MAGIC "FSHOT01"
+
+/* Header of a hints file, followed by struct hint in block order */
+struct hints_header {
+	char magic[8];
+	uint64_t bcount;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+/* One block of a hints file, and the number of times it was used */
+struct hint {
+	uint32_t block;
+	uint32_t uses;
+};
+
+/* Image opened for positional I/O */
+static struct {
+	/* File descriptor */
+	int fd;
+	/* Block count */
+	size_t bcount;
+	/* Read-only mapping of the whole image, NULL if opened for writing */
+	const char *map;
+	/* Writable mapping of wcount blocks from block wblock, see blk_map() */
+	char *wmap;
+	size_t wblock;
+	size_t wcount;
+	/* Hints file of the cache, NULL unless $FS_CACHE_HINTS is 1 */
+	char *hints;
+	/* Thread prefetching the hinted blocks, see blk_hints_load() */
+	pthread_t prefetch;
+	int prefetching;
+	int prefetch_stop;
+} image = { .fd = INVALID_FD };
+
+/*
+ * One set of the block cache. A block can only be cached in the set its number
+ * maps to, and the least recently used of the set's ways is replaced on a miss.
+ * The lock is held across the disk transfer of a miss so that a concurrent
+ * write of the same block cannot be overwritten by stale data.
+ */
+struct cache_set {
+	pthread_mutex_t lock;
+	size_t tag[CACHE_WAYS];
+	uint64_t stamp[CACHE_WAYS];
+	/* Number of accesses since the block was cached */
+	uint32_t uses[CACHE_WAYS];
+	char *data;
+};
+
+/* Write-through block cache of the image, disabled when nsets is 0 */
+static struct {
+	size_t nsets;
+	struct cache_set *set;
+	/* Data of every set, mapped at once so pages are only faulted in when used */
+	char *data;
+	uint64_t clock;
+} cache;
+
+/*
+ * Allocate the block cache, sized by $FS_CACHE_BLOCKS but never larger than the
+ * image, since short-lived processes pay for every set they initialize.
+ */
+static void cache_init(void)
+{
+	const char *env = getenv("FS_CACHE_BLOCKS");
+	size_t blocks = env ? strtoul(env, NULL, 0) : CACHE_BLOCKS;
+
+	if (blocks > image.bcount) {
+		blocks = image.bcount;
+	}
+	cache.nsets = (blocks + CACHE_WAYS - 1) / CACHE_WAYS;
+	if (cache.nsets == 0) {
+		return;
+	}
+
+	cache.set = calloc(cache.nsets, sizeof(struct cache_set));
+	cache.data = mmap(NULL, cache.nsets * CACHE_WAYS * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (cache.set == NULL || cache.data == MAP_FAILED) {
+		// either may have succeeded alone
+		if (cache.data != MAP_FAILED) {
+			munmap(cache.data, cache.nsets * CACHE_WAYS * BLOCK_SIZE);
+		}
+		free(cache.set);
+		cache.set = NULL;
+		cache.data = NULL;
+		cache.nsets = 0;
+		return;
+	}
+
+	for (size_t i = 0; i < cache.nsets; i++) {
+		struct cache_set *set = &cache.set[i];
+		pthread_mutex_init(&set->lock, NULL);
+		for (int w = 0; w < CACHE_WAYS; w++) {
+			set->tag[w] = NO_BLOCK;
+		}
+		set->data = cache.data + i * CACHE_WAYS * BLOCK_SIZE;
+	}
+}
+
+/* Free the block cache */
+static void cache_release(void)
+{
+	for (size_t i = 0; i < cache.nsets; i++) {
+		pthread_mutex_destroy(&cache.set[i].lock);
+	}
+	if (cache.data) {
+		munmap(cache.data, cache.nsets * CACHE_WAYS * BLOCK_SIZE);
+	}
+	free(cache.set);
+	cache.set = NULL;
+	cache.data = NULL;
+	cache.nsets = 0;
+}
+
+/*
+ * Return the way of @set holding @block, or if it is not cached, the least
+ * recently used way to replace with it. Called with the set locked.
+ */
+static int cache_way(struct cache_set *set, size_t block)
+{
+	int lru = 0;
+
+	for (int w = 0; w < CACHE_WAYS; w++) {
+		if (set->tag[w] == block) {
+			return w;
+		}
+		if (set->stamp[w] < set->stamp[lru]) {
+			lru = w;
+		}
+	}
+
+	return lru;
+}
+
+/* Mark way @w of @set as just used */
+static void cache_touch(struct cache_set *set, int w)
+{
+	set->stamp[w] = __atomic_add_fetch(&cache.clock, 1, __ATOMIC_RELAXED);
+	set->uses[w]++;
+}
+
+int blk_open(const char *diskname)
+{
+	int fd;
+	struct stat st;
+
+	if (image.fd != INVALID_FD) {
+		blk_error("disk already open");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	image.fd = fd;
+	image.bcount = st.st_size / BLOCK_SIZE;
+	emu_init(image.bcount);
+	cache_init();
+
+	const char *hints = getenv("FS_CACHE_HINTS");
+	if (cache.nsets && hints && !strcmp(hints, "1")) {
+		image.hints = malloc(strlen(diskname) + sizeof(".hot"));
+		if (image.hints) {
+			strcpy(image.hints, diskname);
+			strcat(image.hints, ".hot");
+		}
+	}
+
+	return 0;
+}
+
+int blk_open_ro(const char *diskname)
+{
+	int fd;
+	struct stat st;
+	void *map;
+
+	if (image.fd != INVALID_FD) {
+		blk_error("disk already open");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	/* The disk image's size should be a multiple of the block size */
+	if (st.st_size == 0 || st.st_size % BLOCK_SIZE != 0) {
+		blk_error("size '%zu' is not multiple of '%d'",
+			  (size_t)st.st_size, BLOCK_SIZE);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+
+	image.fd = fd;
+	image.bcount = st.st_size / BLOCK_SIZE;
+	image.map = map;
+	emu_init(image.bcount);
+
+	return 0;
+}
+
+int blk_close(void)
+{
+	if (image.fd == INVALID_FD) {
+		blk_error("no disk currently open");
+		return -1;
+	}
+
+	if (image.map) {
+		munmap((void *)image.map, image.bcount * BLOCK_SIZE);
+		image.map = NULL;
+	}
+	blk_unmap();
+	if (image.prefetching) {
+		__atomic_store_n(&image.prefetch_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(image.prefetch, NULL);
+		image.prefetching = 0;
+	}
+	free(image.hints);
+	image.hints = NULL;
+	cache_release();
+
+	close(image.fd);
+	image.fd = INVALID_FD;
+
+	return 0;
+}
+
+int blk_count(void)
+{
+	if (image.fd == INVALID_FD) {
+		blk_error("no disk currently open");
+		return -1;
+	}
+
+	return image.bcount;
+}
+
+const void *blk_data(size_t block)
+{
+	if (image.map == NULL || block >= image.bcount) {
+		return NULL;
+	}
+
+	return image.map + block * BLOCK_SIZE;
+}
+
+/* Transfer @block of the image to @buf, at the pace of the emulated device */
+static int image_read(size_t block, void *buf)
+{
+	emu_transfer(block, 1, 0);
+	return pread(image.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+}
+
+/* Transfer @buf to @block of the image, at the pace of the emulated device */
+static int image_write(size_t block, const void *buf)
+{
+	emu_transfer(block, 1, 1);
+	return pwrite(image.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+}
+
+/* Read @block into @buf, through the cache */
+static int blk_read_cached(size_t block, void *buf)
+{
+	if (image.fd == INVALID_FD) {
+		blk_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= image.bcount) {
+		blk_error("block index out of bounds (%zu/%zu)",
+			  block, image.bcount);
+		return -1;
+	}
+
+	if (image.map) {
+		emu_transfer(block, 1, 0);
+		memcpy(buf, image.map + block * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
+	}
+
+	if (cache.nsets == 0) {
+		if (image_read(block, buf)) {
+			perror("pread");
+			return -1;
+		}
+		return 0;
+	}
+
+	struct cache_set *set = &cache.set[block % cache.nsets];
+	pthread_mutex_lock(&set->lock);
+
+	int w = cache_way(set, block);
+	char *data = set->data + w * BLOCK_SIZE;
+
+	// miss, fill the least recently used way from the disk
+	if (set->tag[w] != block) {
+		STATS_ADD(cache_misses, 1);
+		PROBE1(cache__miss, block);
+		if (set->tag[w] != NO_BLOCK) {
+			STATS_ADD(cache_evictions, 1);
+		}
+		if (image_read(block, data)) {
+			set->tag[w] = NO_BLOCK;
+			pthread_mutex_unlock(&set->lock);
+			perror("pread");
+			return -1;
+		}
+		set->tag[w] = block;
+		set->uses[w] = 0;
+	} else {
+		STATS_ADD(cache_hits, 1);
+		PROBE1(cache__hit, block);
+	}
+
+	cache_touch(set, w);
+	memcpy(buf, data, BLOCK_SIZE);
+
+	pthread_mutex_unlock(&set->lock);
+
+	return 0;
+}
+
+/* Write @buf to @block, through the cache */
+static int blk_write_cached(size_t block, const void *buf)
+{
+	if (image.fd == INVALID_FD) {
+		blk_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= image.bcount) {
+		blk_error("block index out of bounds (%zu/%zu)",
+			  block, image.bcount);
+		return -1;
+	}
+
+	if (image.map) {
+		blk_error("disk is read-only");
+		return -1;
+	}
+
+	if (cache.nsets == 0) {
+		if (image_write(block, buf)) {
+			perror("pwrite");
+			return -1;
+		}
+		return 0;
+	}
+
+	struct cache_set *set = &cache.set[block % cache.nsets];
+	pthread_mutex_lock(&set->lock);
+
+	// write through, updating the block if it is cached. Others are not
+	// cached: files are mostly written once, and filling ways with them
+	// would evict what is read, for the cost of faulting the ways in
+	int w = cache_way(set, block);
+	if (image_write(block, buf)) {
+		if (set->tag[w] == block) {
+			set->tag[w] = NO_BLOCK;
+		}
+		pthread_mutex_unlock(&set->lock);
+		perror("pwrite");
+		return -1;
+	}
+
+	if (set->tag[w] == block) {
+		cache_touch(set, w);
+		memcpy(set->data + w * BLOCK_SIZE, buf, BLOCK_SIZE);
+	}
+
+	pthread_mutex_unlock(&set->lock);
+
+	return 0;
+}
+
+int blk_read(size_t block, void *buf)
+{
+	uint64_t start = stats_start();
+	PROBE1(block__read, block);
+	int ret = blk_read_cached(block, buf);
+
+	stats_end(FS_STAT_BLOCK_READ, start, ret, ret == 0 ? BLOCK_SIZE : 0);
+
+	return ret;
+}
+
+/*
+ * Read consecutive blocks from @block into @iov, @size bytes in all, as one
+ * transfer. The cache is bypassed: being written through, it never holds data
+ * newer than the image.
+ */
+static int blk_readv_direct(size_t block, const struct iovec *iov, int iovcnt, size_t size)
+{
+	size_t count = size / BLOCK_SIZE;
+
+	if (image.fd == INVALID_FD) {
+		blk_error("no disk currently open");
+		return -1;
+	}
+
+	if (size % BLOCK_SIZE || block > image.bcount || count > image.bcount - block) {
+		blk_error("block range out of bounds (%zu+%zu/%zu)",
+			  block, count, image.bcount);
+		return -1;
+	}
+
+	emu_transfer(block, count, 0);
+
+	if (image.map) {
+		const char *p = image.map + block * BLOCK_SIZE;
+		for (int i = 0; i < iovcnt; i++) {
+			memcpy(iov[i].iov_base, p, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+		return 0;
+	}
+
+	if (preadv(image.fd, iov, iovcnt, block * BLOCK_SIZE) != (ssize_t)size) {
+		perror("preadv");
+		return -1;
+	}
+
+	return 0;
+}
+
+int blk_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	uint64_t start = stats_start();
+	size_t size = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		size += iov[i].iov_len;
+	}
+
+	PROBE1(block__read, block);
+	int ret = blk_readv_direct(block, iov, iovcnt, size);
+
+	stats_end(FS_STAT_BLOCK_READ, start, ret, ret == 0 ? size : 0);
+
+	return ret;
+}
+
+/*
+ * Cache @block ahead of its use, if its set has an empty way: prefetching
+ * never evicts a block that was actually used.
+ */
+static void cache_prefetch(size_t block)
+{
+	struct cache_set *set = &cache.set[block % cache.nsets];
+	pthread_mutex_lock(&set->lock);
+
+	int w = cache_way(set, block);
+	if (set->tag[w] == NO_BLOCK) {
+		if (image_read(block, set->data + w * BLOCK_SIZE) == 0) {
+			set->tag[w] = block;
+			set->uses[w] = 0;
+			set->stamp[w] = __atomic_add_fetch(&cache.clock, 1, __ATOMIC_RELAXED);
+			STATS_ADD(cache_prefetched, 1);
+		}
+	}
+
+	pthread_mutex_unlock(&set->lock);
+}
+
+static int hint_cmp(const void *a, const void *b)
+{
+	const struct hint *x = a, *y = b;
+
+	return (x->block > y->block) - (x->block < y->block);
+}
+
+/* Prefetch the hints @arg, in block order, until blk_close() */
+static void *hints_prefetch(void *arg)
+{
+	struct hints_header *header = arg;
+	struct hint *hint = (struct hint *)(header + 1);
+
+	for (size_t i = 0; i < header->count; i++) {
+		if (__atomic_load_n(&image.prefetch_stop, __ATOMIC_RELAXED)) {
+			break;
+		}
+		cache_prefetch(hint[i].block);
+	}
+
+	free(header);
+	return NULL;
+}
+
+void blk_hints_load(void)
+{
+	struct hints_header header, *hints;
+	FILE *f;
+
+	if (image.hints == NULL || image.prefetching || (f = fopen(image.hints, "r")) == NULL) {
+		return;
+	}
+
+	// ignore hints of another image, or that cannot be read whole
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, HINTS_MAGIC, sizeof(header.magic)) ||
+	    header.bcount != image.bcount || header.count > image.bcount ||
+	    (hints = malloc(sizeof(header) + header.count * sizeof(struct hint))) == NULL) {
+		fclose(f);
+		return;
+	}
+	*hints = header;
+	struct hint *hint = (struct hint *)(hints + 1);
+	if (fread(hint, sizeof(struct hint), header.count, f) != header.count) {
+		free(hints);
+		fclose(f);
+		return;
+	}
+	fclose(f);
+
+	// drop out of bound blocks, then read the rest in disk order
+	size_t n = 0;
+	for (size_t i = 0; i < hints->count; i++) {
+		if (hint[i].block < image.bcount) {
+			hint[n++] = hint[i];
+		}
+	}
+	hints->count = n;
+	qsort(hint, n, sizeof(struct hint), hint_cmp);
+
+	image.prefetch_stop = 0;
+	if (pthread_create(&image.prefetch, NULL, hints_prefetch, hints)) {
+		free(hints);
+		return;
+	}
+	image.prefetching = 1;
+}
+
+int blk_hints_save(void)
+{
+	struct hints_header header = { .magic = HINTS_MAGIC, .bcount = image.bcount };
+	struct hint *hint;
+	FILE *f;
+	int ret = 0;
+
+	if (image.hints == NULL) {
+		return 0;
+	}
+
+	hint = malloc(cache.nsets * CACHE_WAYS * sizeof(*hint));
+	if (hint == NULL) {
+		return -1;
+	}
+
+	// blocks that were prefetched but never used are not hot
+	for (size_t s = 0; s < cache.nsets; s++) {
+		struct cache_set *set = &cache.set[s];
+		pthread_mutex_lock(&set->lock);
+		for (int w = 0; w < CACHE_WAYS; w++) {
+			if (set->tag[w] != NO_BLOCK && set->uses[w]) {
+				hint[header.count].block = set->tag[w];
+				hint[header.count].uses = set->uses[w];
+				header.count++;
+			}
+		}
+		pthread_mutex_unlock(&set->lock);
+	}
+	qsort(hint, header.count, sizeof(*hint), hint_cmp);
+
+	f = fopen(image.hints, "w");
+	if (f == NULL) {
+		free(hint);
+		return -1;
+	}
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+	    fwrite(hint, sizeof(*hint), header.count, f) != header.count) {
+		ret = -1;
+	}
+	if (fclose(f) == EOF) {
+		ret = -1;
+	}
+	free(hint);
+
+	return ret;
+}
+
+void *blk_map(size_t block, size_t count)
+{
+	if (image.fd == INVALID_FD || image.map || image.wmap) {
+		return NULL;
+	}
+	if (count == 0 || block > image.bcount || count > image.bcount - block) {
+		return NULL;
+	}
+
+	// private, so that the disk only changes when the blocks are written back
+	void *map = mmap(NULL, count * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			 image.fd, block * BLOCK_SIZE);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	// the pages are faulted in later, but count them as read now
+	emu_transfer(block, count, 0);
+
+	image.wmap = map;
+	image.wblock = block;
+	image.wcount = count;
+
+	return map;
+}
+
+int blk_map_sync(size_t block, size_t count)
+{
+	if (image.wmap == NULL || block < image.wblock || count > image.wcount ||
+	    block - image.wblock > image.wcount - count) {
+		blk_error("blocks not mapped (%zu+%zu)", block, count);
+		return -1;
+	}
+
+	uint64_t start = stats_start();
+	PROBE1(block__write, block);
+	emu_transfer(block, count, 1);
+
+	// changes to a private mapping never reach the file by themselves
+	const char *p = image.wmap + (block - image.wblock) * BLOCK_SIZE;
+	int ret = 0;
+	if (pwrite(image.fd, p, count * BLOCK_SIZE, block * BLOCK_SIZE) != (ssize_t)(count * BLOCK_SIZE)) {
+		perror("pwrite");
+		ret = -1;
+	}
+
+	stats_end(FS_STAT_BLOCK_WRITE, start, ret, ret == 0 ? count * BLOCK_SIZE : 0);
+
+	return ret;
+}
+
+void blk_unmap(void)
+{
+	if (image.wmap) {
+		munmap(image.wmap, image.wcount * BLOCK_SIZE);
+		image.wmap = NULL;
+	}
+}
+
+int blk_advise(size_t block, size_t count, int advice)
+{
+	if (image.fd == INVALID_FD) {
+		return -1;
+	}
+	if (block > image.bcount || count > image.bcount - block) {
+		blk_error("blocks out of bounds (%zu+%zu)", block, count);
+		return -1;
+	}
+	if (advice != BLK_ADV_WILLNEED && advice != BLK_ADV_DONTNEED) {
+		return -1;
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	off_t offset = block * BLOCK_SIZE;
+	off_t len = count * BLOCK_SIZE;
+
+	if (image.map) {
+		// reads are served from the mapping, so read ahead into it and
+		// unmap the pages, which fadvise() cannot drop while they are mapped
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t skip = offset % page;
+		int madv = advice == BLK_ADV_WILLNEED ? MADV_WILLNEED : MADV_DONTNEED;
+		if (madvise((void *)(image.map + offset - skip), len + skip, madv) == -1) {
+			perror("madvise");
+			return -1;
+		}
+		if (advice == BLK_ADV_WILLNEED) {
+			return 0;
+		}
+	}
+
+	int fadv = advice == BLK_ADV_WILLNEED ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED;
+	int err = posix_fadvise(image.fd, offset, len, fadv);
+	if (err) {
+		blk_error("posix_fadvise: %s", strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+int blk_write(size_t block, const void *buf)
+{
+	uint64_t start = stats_start();
+	PROBE1(block__write, block);
+	int ret = blk_write_cached(block, buf);
+
+	stats_end(FS_STAT_BLOCK_WRITE, start, ret, ret == 0 ? BLOCK_SIZE : 0);
+
+	return ret;
+}
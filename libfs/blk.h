@@ -0,0 +1,189 @@
+#ifndef _BLK_H
+#define _BLK_H
+
+/*
+ * Internal block I/O layer used by fs.c.
+ *
+ * disk.c moves a single shared file offset with lseek() before every transfer,
+ * so its block_read()/block_write() cannot be called from several threads at
+ * once. This layer opens its own descriptor on the image and transfers blocks
+ * with positional I/O, which is safe to use concurrently.
+ *
+ * Blocks of a disk opened with blk_open() go through a write-through cache of
+ * $FS_CACHE_BLOCKS blocks (1024 by default, 0 disables it). Reads fill it,
+ * writes only update the blocks it already holds.
+ * Transfers to and from the image itself are paced by the emulated device of
+ * emu.h when $FS_EMU is set.
+ *
+ * With $FS_CACHE_HINTS set to 1, the blocks in the cache can be recorded in a
+ * hints file next to the disk, named after it with a ".hot" suffix, and
+ * prefetched when the disk is opened again (see blk_hints_save()).
+ */
+
+#include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
+
+/**
+ * blk_open - Open virtual disk file for positional I/O
+ * @diskname: Name of the virtual disk file
+ *
+ * Return: -1 if the file cannot be opened or a disk is already open. 0
+ * otherwise.
+ */
+int blk_open(const char *diskname);
+
+/**
+ * blk_open_ro - Map virtual disk file read-only
+ * @diskname: Name of the virtual disk file
+ *
+ * Open @diskname read-only and map it in memory. Reads are then served from the
+ * mapping (see blk_data()), which the host shares between every process that
+ * maps the same image, and writes fail.
+ *
+ * Return: -1 if the file cannot be opened or mapped, if its size is not a
+ * multiple of %BLOCK_SIZE, or if a disk is already open. 0 otherwise.
+ */
+int blk_open_ro(const char *diskname);
+
+/**
+ * blk_close - Close the virtual disk file opened by blk_open()
+ *
+ * Return: -1 if no disk is open. 0 otherwise.
+ */
+int blk_close(void);
+
+/**
+ * blk_count - Get disk's block count
+ *
+ * Return: -1 if no disk is open, otherwise the number of blocks of the disk.
+ */
+int blk_count(void);
+
+/**
+ * blk_data - Get a read-only mapped block
+ * @block: Index of the block
+ *
+ * Return: NULL if the disk was not opened with blk_open_ro() or if @block is
+ * out of bounds, otherwise the address of the block in the mapping.
+ */
+const void *blk_data(size_t block);
+
+/**
+ * blk_read - Read a block from disk
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if @block is out of bounds or the read fails. 0 otherwise.
+ */
+int blk_read(size_t block, void *buf);
+
+/**
+ * blk_readv - Read consecutive blocks from disk at once
+ * @block: Index of the first block to read from
+ * @iov: Buffers to be filled with the content of the blocks, in order
+ * @iovcnt: Number of buffers
+ *
+ * Read as many blocks as the buffers hold in all, with a single transfer that
+ * bypasses the cache. Buffers need not be block-sized, but their total size
+ * must be a multiple of %BLOCK_SIZE.
+ *
+ * Return: -1 if the total size is not a multiple of %BLOCK_SIZE, if the blocks
+ * are out of bounds or if the read fails. 0 otherwise.
+ */
+int blk_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * blk_write - Write a block to disk
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Return: -1 if @block is out of bounds or the write fails. 0 otherwise.
+ */
+int blk_write(size_t block, const void *buf);
+
+/**
+ * blk_hints_load - Warm the cache up with the hinted blocks
+ *
+ * Start prefetching the blocks recorded by the last blk_hints_save() of the
+ * disk, in disk order, on a thread of its own, which blk_close() stops.
+ * Prefetched blocks only fill empty cache ways. Does nothing if hints are off
+ * or the hints file is missing or was saved for a disk of another size.
+ */
+void blk_hints_load(void);
+
+/**
+ * blk_hints_save - Record the blocks in the cache
+ *
+ * Write the cached blocks that were used since they were cached, and how many
+ * times, to the hints file for the next blk_hints_load().
+ *
+ * Return: -1 if the hints file cannot be written. 0 otherwise, including when
+ * hints are off.
+ */
+int blk_hints_save(void);
+
+/**
+ * blk_map - Map blocks of the disk for reading and writing
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Map the blocks from the virtual disk file, so that they are only read when
+ * first accessed and never copied. The mapping is private: changes made
+ * through it only reach the disk when blk_map_sync() writes them back, like
+ * changes to a copy would. Only one such mapping can exist at a time, and its
+ * blocks must not be accessed with blk_read() or blk_write() meanwhile, as the
+ * cache would not see the changes.
+ *
+ * Return: NULL if the disk was not opened with blk_open(), if a mapping already
+ * exists, if the blocks are out of bounds or if they cannot be mapped, e.g.
+ * because the host's pages are larger than %BLOCK_SIZE. Otherwise the address
+ * of the mapping.
+ */
+void *blk_map(size_t block, size_t count);
+
+/**
+ * blk_map_sync - Write back mapped blocks
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Write blocks of the mapping of blk_map() to the disk, with the changes made
+ * to them. Like blk_write(), this leaves them in the host's page cache.
+ *
+ * Return: -1 if the blocks are not all mapped or the write-back fails. 0
+ * otherwise.
+ */
+int blk_map_sync(size_t block, size_t count);
+
+/**
+ * blk_unmap - Remove the mapping of blk_map()
+ *
+ * blk_close() also removes it.
+ */
+void blk_unmap(void);
+
+/* Advice of blk_advise() */
+enum {
+	/* The blocks will be read soon */
+	BLK_ADV_WILLNEED,
+	/* The blocks will not be read again soon */
+	BLK_ADV_DONTNEED,
+};
+
+/**
+ * blk_advise - Tell the host how blocks of the disk will be used
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @advice: %BLK_ADV_WILLNEED or %BLK_ADV_DONTNEED
+ *
+ * Pass @advice on to the host's page cache, which does not know how the blocks
+ * of the virtual disk file are used: start reading the blocks ahead of their
+ * use, or drop them so that a one-shot scan does not evict blocks that are used
+ * again. The advice goes to the read-only mapping of blk_open_ro(), if any, and
+ * to the file. The block cache is left alone.
+ *
+ * Return: -1 if no disk is open, if the blocks are out of bounds, if @advice is
+ * invalid or if the host rejects it. 0 otherwise.
+ */
+int blk_advise(size_t block, size_t count, int advice);
+
+#endif /* _BLK_H */
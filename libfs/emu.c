@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+#include "emu.h"
+#include "stats.h"
+
+#define emu_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Costs of the emulated device, times in nanoseconds */
+struct emu_model {
+	uint64_t lat;
+	uint64_t seek;
+	uint64_t stroke;
+	/* MB/s, 0 for no limit */
+	uint64_t bw;
+	int sleep;
+};
+
+static const struct {
+	const char *name;
+	struct emu_model model;
+} emu_presets[] = {
+	// 7200 rpm disk: half a rotation plus settling for any seek, 8 ms full stroke
+	{ "hdd", { .lat = 50000, .seek = 4000000, .stroke = 8000000, .bw = 150, .sleep = 1 } },
+	// SATA flash: no seeks, command latency dominates small transfers
+	{ "ssd", { .lat = 80000, .bw = 500, .sleep = 1 } },
+};
+
+static struct {
+	int on;
+	struct emu_model model;
+	size_t bcount;
+	/* Guards head and busy */
+	pthread_mutex_t lock;
+	/* Block following the last one transferred */
+	size_t head;
+	/* Time the device is done with the queued requests */
+	uint64_t busy;
+} emu = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Parse @spec into @m, return -1 if it is invalid */
+static int emu_parse(const char *spec, struct emu_model *m)
+{
+	char *copy = strdup(spec);
+	char *save, *tok;
+	int ret = 0;
+
+	if (copy == NULL) {
+		return -1;
+	}
+
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(tok, '=');
+		char *end;
+
+		if (eq == NULL) {
+			size_t i;
+			for (i = 0; i < sizeof(emu_presets) / sizeof(emu_presets[0]); i++) {
+				if (!strcmp(tok, emu_presets[i].name)) {
+					*m = emu_presets[i].model;
+					break;
+				}
+			}
+			if (i == sizeof(emu_presets) / sizeof(emu_presets[0])) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
+		*eq = '\0';
+		uint64_t value = strtoull(eq + 1, &end, 0);
+		if (eq[1] == '\0' || *end != '\0') {
+			ret = -1;
+			break;
+		}
+
+		if (!strcmp(tok, "lat")) {
+			m->lat = value * 1000;
+		} else if (!strcmp(tok, "seek")) {
+			m->seek = value * 1000;
+		} else if (!strcmp(tok, "stroke")) {
+			m->stroke = value * 1000;
+		} else if (!strcmp(tok, "bw")) {
+			m->bw = value;
+		} else if (!strcmp(tok, "sleep")) {
+			m->sleep = value != 0;
+		} else {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(copy);
+	return ret;
+}
+
+void emu_init(size_t bcount)
+{
+	const char *spec = getenv("FS_EMU");
+	struct emu_model model = { .sleep = 1 };
+
+	emu.on = 0;
+	if (spec == NULL || *spec == '\0') {
+		return;
+	}
+	if (emu_parse(spec, &model)) {
+		emu_error("invalid $FS_EMU '%s', device emulation is off", spec);
+		return;
+	}
+
+	emu.model = model;
+	emu.bcount = bcount ? bcount : 1;
+	emu.head = 0;
+	emu.busy = 0;
+	emu.on = 1;
+}
+
+void emu_transfer(size_t block, size_t count, int write)
+{
+	if (!emu.on) {
+		return;
+	}
+
+	uint64_t cost = emu.model.lat;
+	uint64_t now = now_ns();
+	uint64_t done;
+	size_t dist = 0;
+	int seek = 0;
+
+	if (emu.model.bw) {
+		// bytes / (MB/s) is in microseconds
+		cost += (uint64_t)count * BLOCK_SIZE * 1000 / emu.model.bw;
+	}
+
+	pthread_mutex_lock(&emu.lock);
+	if (block != emu.head) {
+		seek = 1;
+		dist = block > emu.head ? block - emu.head : emu.head - block;
+		cost += emu.model.seek + emu.model.stroke * dist / emu.bcount;
+	}
+	emu.head = block + count;
+	done = (emu.busy > now ? emu.busy : now) + cost;
+	emu.busy = done;
+	pthread_mutex_unlock(&emu.lock);
+
+	if (seek) {
+		STATS_ADD(emu_seeks, 1);
+		STATS_ADD(emu_seek_blocks, dist);
+	}
+	if (write) {
+		STATS_ADD(emu_bytes_written, count * BLOCK_SIZE);
+	} else {
+		STATS_ADD(emu_bytes_read, count * BLOCK_SIZE);
+	}
+	STATS_ADD(emu_busy_ns, cost);
+
+	if (emu.model.sleep) {
+		struct timespec ts = {
+			.tv_sec = done / 1000000000,
+			.tv_nsec = done % 1000000000,
+		};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+			;
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef _EMU_H
+#define _EMU_H
+
+/*
+ * Internal emulation of a slow block device, used by blk.c.
+ *
+ * When $FS_EMU is set, every block transferred to or from the image, i.e. not
+ * served by the block cache, is charged the cost it would have on the emulated
+ * device and the calling thread sleeps until the device would be done with it.
+ * The device serves one request at a time, so concurrent requests queue up.
+ *
+ * $FS_EMU is a comma separated list of a preset, "hdd" or "ssd", and of
+ * key=value settings overriding it:
+ *   lat=<us>    fixed cost of every request
+ *   seek=<us>   cost of a request that does not follow the previous one
+ *   stroke=<us> extra seek cost across the whole image, proportional to the
+ *               distance between the two blocks
+ *   bw=<MB/s>   transfer bandwidth, 0 for no limit
+ *   sleep=<0|1> 0 only accounts the device time in fs_stats(), without
+ *               sleeping, for deterministic runs
+ * e.g. FS_EMU=hdd,bw=80 or FS_EMU=lat=20,bw=2000.
+ */
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * emu_init - Set up the emulated device for a newly opened image
+ * @bcount: Block count of the image
+ *
+ * Read $FS_EMU and put the emulated head back on block 0.
+ */
+void emu_init(size_t bcount);
+
+/**
+ * emu_transfer - Charge a transfer to the emulated device
+ * @block: Index of the first block
+ * @count: Number of consecutive blocks, transferred as one request
+ * @write: 1 for a write, 0 for a read
+ *
+ * Return once the emulated device is done with the transfer. Does nothing if
+ * $FS_EMU is not set.
+ */
+void emu_transfer(size_t block, size_t count, int write);
+
+#endif /* _EMU_H */
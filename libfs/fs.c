@@ -1,12 +1,64 @@
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "blk.h"
 #include "disk.h"
 #include "fs.h"
+#include "fs_ext.h"
+#include "pool.h"
+#include "probe.h"
+#include "rcu.h"
+#include "record.h"
+#include "stats.h"
+#include "trace.h"
+
+/* FAT value marking the end of a chain, and the data_index of an empty file */
+#define FAT_EOC 0xFFFF
+
+/* Descriptors are allocated in chunks of this many open files */
+#define FD_CHUNK 64
+
+/* Number of chunks needed to reach FS_OPEN_LIMIT descriptors */
+#define FD_CHUNKS (FS_OPEN_LIMIT / FD_CHUNK)
+
+/* Number of locks guarding partial-block read-modify-write cycles */
+#define BLOCK_LOCKS 64
+
+/* Default size in blocks from which transfers are split across the worker pool */
+#define PARALLEL_BLOCKS 256
+
+/* Smallest share of a split transfer, in blocks */
+#define PARALLEL_MIN_SHARE 16
+
+/*
+ * super.state of an image that libfs never mounted for writing, e.g. made by
+ * fs_make.x, of an image that was unmounted cleanly, and of one that is mounted
+ * or was not unmounted cleanly
+ */
+#define STATE_UNKNOWN 0x00
+#define STATE_CLEAN 0x01
+#define STATE_DIRTY 0x02
+
+/* Allocated blocks from which a check walks the chains on the worker pool */
+#define CHECK_PARALLEL_BLOCKS 4096
+
+/* Directory entries whose chains one share of a parallel check walks */
+#define CHECK_SHARE 16
+
+/* Reads following each other on a descriptor before its blocks are read ahead */
+#define ADVISE_STREAK 2
+
+/* Minimum number of blocks of a file announced ahead of a sequential reader */
+#define ADVISE_WINDOW 64
 
 struct SuperBlock {
 	char signature[8];
@@ -15,11 +67,21 @@ struct SuperBlock {
 	uint16_t data_index;
 	uint16_t data_blocks;
 	uint8_t fat_blocks;
-	uint8_t unused_padding[4079];
+	/* STATE_CLEAN if nothing changed the image since a clean unmount */
+	uint8_t state;
+	uint8_t unused_padding[4078];
 } __attribute__((packed));
 
+/* Number of 64-bit words in the bitmap of modified FAT blocks */
+#define FAT_DIRTY_WORDS ((UINT8_MAX + 63) / 64)
+
+/*
+ * In-memory FAT. Blocks of it that were modified since the last commit are
+ * marked in dirty, so that only those are written back.
+ */
 struct FAT {
 	uint16_t *flat;
+	uint64_t dirty[FAT_DIRTY_WORDS];
 } __attribute__((packed));
 
 struct Entry {
@@ -33,483 +95,2467 @@ struct RootDirectory {
 	struct Entry entry[FS_FILE_MAX_COUNT];
 } __attribute__((packed));
 
+/* Number of 64-bit words in the directory occupancy bitmap */
+#define DIR_WORDS (FS_FILE_MAX_COUNT / 64)
+
+/* dir.open value of an entry that is being deleted */
+#define ENTRY_DELETING UINT32_MAX
+
+/*
+ * Names and occupancy bitmap of the directory entries. Names are zero-padded to
+ * FS_FILENAME_LEN and 16-byte aligned so one SIMD compare checks a whole name.
+ *
+ * A published struct Names is never modified: fs_create() and fs_delete()
+ * publish a modified copy and free the old one once no reader can still be
+ * using it (see rcu.h), so lookups take no lock.
+ */
+struct Names {
+	uint8_t filename[FS_FILE_MAX_COUNT][FS_FILENAME_LEN] __attribute__((aligned(16)));
+	uint64_t used[DIR_WORDS];
+};
+
+/*
+ * In-memory mirror of the root directory, kept as parallel arrays so that name
+ * and free-slot scans only touch the bytes they need. The on-disk struct
+ * RootDirectory is only rebuilt from it at unmount. Unlike names, the
+ * per-entry fields are updated in place with atomic accesses.
+ *
+ * reserved is the end of the bytes handed out to appenders, which runs ahead of
+ * file_size while appends are in flight. block_count and tail describe the
+ * file's chain so that it can be extended without walking it.
+ */
+struct Directory {
+	struct Names *names;
+	uint32_t file_size[FS_FILE_MAX_COUNT];
+	uint32_t reserved[FS_FILE_MAX_COUNT];
+	uint32_t open[FS_FILE_MAX_COUNT];
+	uint16_t data_index[FS_FILE_MAX_COUNT];
+	uint16_t block_count[FS_FILE_MAX_COUNT];
+	uint16_t tail[FS_FILE_MAX_COUNT];
+};
+
+/* File flags */
+#define FILE_OPEN 0x1
+#define FILE_APPEND 0x2
+/* fs_advise() pattern hints, see file_advise() */
+#define FILE_SEQUENTIAL 0x4
+#define FILE_RANDOM 0x8
+
+/* Pack and unpack a file cursor */
+#define CURSOR(index, block) ((uint32_t)(index) << 16 | (block))
+#define CURSOR_INDEX(cursor) ((cursor) >> 16)
+#define CURSOR_BLOCK(cursor) ((uint16_t)(cursor))
+
+/*
+ * State of one file descriptor. The cursor packs a block number of the file
+ * and the data block backing it, so that sequential accesses do not walk the
+ * FAT chain from the start every time. It is a single word so that threads
+ * sharing a descriptor never see half of an update.
+ *
+ * next is the byte following the last read, streak the number of reads in a
+ * row that started there and advised the end of the blocks announced to the
+ * host (see file_advise()). They only steer advice, so threads sharing a
+ * descriptor may race on them.
+ */
 struct File {
-	uint8_t filename[FS_FILENAME_LEN];
+	uint16_t entry;
+	uint16_t flags;
+	uint32_t cursor;
 	size_t offset;
+	uint32_t next;
+	uint16_t streak;
+	uint16_t advised;
 };
 
+/*
+ * Growable descriptor table. Descriptors live in fixed-size chunks that never
+ * move once allocated, so a descriptor can be looked up without the lock. Free
+ * descriptors are tracked by a two-level bitmap (a set bit in summary means the
+ * corresponding free word is non-zero), which finds the lowest free descriptor
+ * in constant time.
+ */
 struct Files {
-	int open;
-	struct File file[FS_OPEN_MAX_COUNT];
+	pthread_mutex_t lock;
+	size_t open;
+	size_t limit;
+	size_t chunks;
+	struct File *chunk[FD_CHUNKS];
+	uint64_t free[FD_CHUNKS];
+	uint64_t summary[FD_CHUNKS / 64];
+};
+
+/*
+ * Index of a read-only mount: the data blocks of every file, resolved once at
+ * mount so that reads never walk the FAT. extent[first[i] + n] is the data
+ * block backing block number n of entry i.
+ */
+struct Extents {
+	uint16_t *extent;
+	uint32_t first[FS_FILE_MAX_COUNT];
 };
 
 struct SuperBlock super;
 struct FAT fat;
+struct Extents extents;
 struct RootDirectory root;
-struct Files files;
+/* Root directory being used, root or the one in the metadata mapping */
+static struct RootDirectory *rootdir = &root;
+struct Directory dir;
+struct Files files = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.limit = FS_OPEN_MAX_COUNT,
+};
 
-int fs_mount(const char *diskname)
-{
-	// return -1 if virtual disk file does not open
-	if (block_disk_open(diskname) == -1) {
-		return -1;
-	}
+/* Set while the file system is mounted with fs_mount_ro() */
+static int read_only;
 
-	// read super block
-	block_read(0, &super);
+/* Set while the mounted image has problems fs_check() should repair */
+static int check_needed;
 
-	// minimum capacity for fat
-	uint8_t fat_min = (super.data_blocks * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+/* Set while the FAT and the root directory are mapped from the disk, see meta_load() */
+static int meta_mapped;
 
-	// return -1 if signature is not ECS150FS
-	if (memcmp("ECS150FS", super.signature, 8) != 0) {
-		return -1;
-	}
-	// return -1 if number of blocks in super does not match total blocks
-	if (super.fat_blocks + super.data_blocks != super.total_blocks - 2) {
-		return -1;
-	}
-	// return -1 if total blocks in super block does not match block disk count
-	if (super.total_blocks != block_disk_count()) {
-		return -1;
-	}
-	// return -1 if super block is not in the correct order
-	if (super.fat_blocks + 1 != super.root_index || super.root_index + 1 != super.data_index) {
+/* Transfers of at least this many blocks use the worker pool, 0 if never */
+static size_t parallel_blocks = PARALLEL_BLOCKS;
+
+/* Serializes changes to the FAT and to the directory */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Transfer split across the worker pool (see file_transfer()), of the blocks of
+ * directory entry entry from block number first on. The bytes of block i of the
+ * transfer are at buf + i * BLOCK_SIZE - offset, except for the first block
+ * which starts at byte offset of its block.
+ */
+struct Transfer {
+	int entry;
+	size_t first;
+	const uint16_t *blocks;
+	size_t count;
+	size_t offset;
+	size_t size;
+	uint8_t *buf;
+	size_t shares;
+	int write;
+	int error;
+};
+
+/*
+ * A partial-block write reads, patches and writes back a whole block. Writers
+ * patching different bytes of one block (e.g. two appenders meeting in the
+ * middle of it) must not interleave, so each cycle holds the lock its block
+ * hashes to.
+ */
+static pthread_mutex_t block_locks[BLOCK_LOCKS] = {
+	[0 ... BLOCK_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+/*
+ * Build a lookup key from @filename: the name zero-padded to FS_FILENAME_LEN.
+ * Return -1 if @filename is NULL, empty or too long.
+ */
+static int dir_key(const char *filename, uint8_t *key)
+{
+	if (filename == NULL || filename[0] == '\0') {
 		return -1;
 	}
-	// return -1 if number of fat blocks is not equal to the min capacity
-	if (super.fat_blocks != fat_min) {
+
+	size_t len = strnlen(filename, FS_FILENAME_LEN);
+	if (len == FS_FILENAME_LEN) {
 		return -1;
 	}
 
-	// allocate fat
-	fat.flat = (uint16_t *)malloc(super.data_blocks * sizeof(uint16_t));
-	// allocate a buffer
-	void *buffer = (void *)malloc(BLOCK_SIZE);
+	memset(key, 0, FS_FILENAME_LEN);
+	memcpy(key, filename, len);
 
-	// read from buffer, transfer to fat
-	for (size_t i = 0; i < super.fat_blocks; i++) {
-		// return -1 if the block read returns -1
-		if (block_read(i + 1, buffer) == -1) {
-			return -1;
+	return 0;
+}
+
+/*
+ * Return the directory index of the file whose name matches @key in @names, or
+ * -1 if there is none. @key must be 16-byte aligned (see dir_key()).
+ */
+static int dir_find(const struct Names *names, const uint8_t *key)
+{
+#ifdef __SSE2__
+	__m128i k = _mm_load_si128((const __m128i *)key);
+#endif
+
+	for (size_t w = 0; w < DIR_WORDS; w++) {
+		uint64_t bits = names->used[w];
+
+		// only compare names of occupied entries
+		while (bits) {
+			size_t i = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+#ifdef __SSE2__
+			__m128i name = _mm_load_si128((const __m128i *)names->filename[i]);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(name, k)) == 0xFFFF) {
+				return i;
+			}
+#else
+			if (memcmp(names->filename[i], key, FS_FILENAME_LEN) == 0) {
+				return i;
+			}
+#endif
 		}
-		// send buffer to fat
-		memcpy(fat.flat + (i * BLOCK_SIZE / 2), buffer, BLOCK_SIZE);
 	}
 
-	// return -1 if first entry is not invalid entry (FFFF)
-	if (fat.flat[0] != 0xFFFF) {
-		return -1;
+	return -1;
+}
+
+/* Return the index of the first clear bit of directory bitmap @used, or -1 if full */
+static int dir_alloc(const uint64_t *used)
+{
+	for (size_t w = 0; w < DIR_WORDS; w++) {
+		if (~used[w]) {
+			return w * 64 + __builtin_ctzll(~used[w]);
+		}
 	}
 
-	// read root
-	block_read(super.root_index, &root);
+	return -1;
+}
 
-	return 0;
+/* Return the published names, only valid inside a read-side section */
+static struct Names *names_get(void)
+{
+	return __atomic_load_n(&dir.names, __ATOMIC_ACQUIRE);
 }
 
-int fs_umount(void)
+/* Return a private copy of the published names, or NULL if out of memory */
+static struct Names *names_copy(void)
 {
-	// write super block, return -1 if no mounted FS
-	if (block_write(0,&super) == -1){
-		return -1;
+	struct Names *names = aligned_alloc(16, sizeof(struct Names));
+
+	if (names != NULL) {
+		memcpy(names, dir.names, sizeof(struct Names));
 	}
 
-	// allocate a buffer
-	void *buffer = (void *)malloc(BLOCK_SIZE);
+	return names;
+}
 
-	//read from fat, transfer to buffer
-	for (size_t i = 0; i < super.fat_blocks; i++) {
-		// send fat to buffer
-		memcpy(buffer, fat.flat + (i * BLOCK_SIZE / 2), BLOCK_SIZE);
+/*
+ * Publish @names in place of the current names, and free the old version once
+ * every reader that could see it is gone. Must be called with fs_lock held.
+ */
+static void names_publish(struct Names *names)
+{
+	struct Names *old = dir.names;
+
+	__atomic_store_n(&dir.names, names, __ATOMIC_RELEASE);
+	rcu_synchronize();
+	free(old);
+}
+
+/*
+ * Count one more open descriptor on @entry. Return -1 if the entry is being
+ * deleted, in which case it must be treated as missing.
+ */
+static int dir_pin(int entry)
+{
+	uint32_t open = __atomic_load_n(&dir.open[entry], __ATOMIC_RELAXED);
 
-		// writes the buffer into fat block, return -1 if issue with writing
-		if (block_write(i + 1, buffer) == -1) {
+	do {
+		if (open == ENTRY_DELETING) {
 			return -1;
 		}
-	}
+	} while (!__atomic_compare_exchange_n(&dir.open[entry], &open, open + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
 
-	// return -1 if issue when writing to super block
-	if (block_write(super.root_index, &root) == -1) {
-		return -1;
-	}
-
-	// close virtual disk, return value returned by block_disk_close function
-	return block_disk_close();
+	return 0;
 }
 
-int fs_info(void)
+/* Mark the FAT block holding the entry of data block @block as modified */
+static void fat_mark(uint16_t block)
 {
-	// print FS Info as follows
-	printf("FS Info:\n");
-	printf("total_blk_count=%" PRIu16 "\n", super.total_blocks);
-	printf("fat_blk_count=%" PRIu8 "\n", super.fat_blocks);
-	printf("rdir_blk=%" PRIu16 "\n", super.root_index);
-	printf("data_blk=%" PRIu16 "\n", super.data_index);
-	printf("data_blk_count=%" PRIu16 "\n", super.data_blocks);
+	size_t i = (size_t)block * 2 / BLOCK_SIZE;
 
-	// set free blocks to 0
-	int free_blocks = 0;
+	fat.dirty[i / 64] |= 1ULL << (i % 64);
+}
 
-	// if fat array at index i is 0, there is a free block
-	for (size_t i = 0; i < super.data_blocks; i++) {
-		if (fat.flat[i] == 0) {
-			free_blocks++;
-		}
+/*
+ * Add an empty file named @key to @names, a private copy of the published
+ * names, in the first entry that is clear in @taken. Return the entry, or -1 if
+ * the file already exists or the directory is full. Must be called with fs_lock
+ * held.
+ */
+static int entry_create(struct Names *names, const uint64_t *taken, const uint8_t *key)
+{
+	if (dir_find(names, key) != -1) {
+		return -1;
 	}
-	// print rest of FS Info
-	printf("fat_free_ratio=%d/%" PRIu16 "\n", free_blocks, super.data_blocks);
 
-	// do the same for last FS Info
-	free_blocks = 0;
-	for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if (root.entry[i].filename[0] == '\0') {
-			free_blocks++;
-		}
+	int entry = dir_alloc(taken);
+	if (entry == -1) {
+		return -1;
 	}
-	
-	printf("rdir_free_ratio=%d/%d\n", free_blocks, FS_FILE_MAX_COUNT);
 
-	return 0;
+	// new files are empty and get their first block on their first write
+	dir.file_size[entry] = 0;
+	dir.reserved[entry] = 0;
+	dir.data_index[entry] = FAT_EOC;
+	dir.block_count[entry] = 0;
+	dir.tail[entry] = FAT_EOC;
+
+	memcpy(names->filename[entry], key, FS_FILENAME_LEN);
+	names->used[entry / 64] |= 1ULL << (entry % 64);
+
+	return entry;
 }
 
-int fs_create(const char *filename)
+/*
+ * Remove the file named @key from @names, a private copy of the published
+ * names. Return the entry, or -1 if there is no such file or it is open. The
+ * entry cannot be opened anymore, but it must only be released with
+ * entry_release() once @names has been published. Must be called with fs_lock
+ * held.
+ */
+static int entry_delete(struct Names *names, const uint8_t *key)
 {
-	// return -1 if filename is not correct length
-	if (strlen(filename) >= FS_FILENAME_LEN) {
+	int entry = dir_find(names, key);
+	if (entry == -1) {
 		return -1;
 	}
 
-	// return -1 if at capacity of open files
-	if (files.open == FS_FILE_MAX_COUNT) {
+	// fail if the file is currently open, otherwise keep it from being opened
+	uint32_t open = 0;
+	if (!__atomic_compare_exchange_n(&dir.open[entry], &open, ENTRY_DELETING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
 		return -1;
 	}
 
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (memcmp(root.entry[i].filename, filename, FS_FILENAME_LEN) == 0) {
-			return -1;
-		}
-	}
+	memset(names->filename[entry], 0, FS_FILENAME_LEN);
+	names->used[entry / 64] &= ~(1ULL << (entry % 64));
 
-	struct Entry *new_entry = NULL;
+	return entry;
+}
 
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root.entry[i].filename[0] == '\0') {
-			new_entry = &root.entry[i];
-			break;
-		}
+/*
+ * Free the data blocks of deleted entry @entry and make it reusable. Must be
+ * called with fs_lock held.
+ */
+static void entry_release(int entry)
+{
+	uint16_t block = dir.data_index[entry];
+
+	while (block != FAT_EOC) {
+		uint16_t next = fat.flat[block];
+		fat.flat[block] = 0;
+		fat_mark(block);
+		STATS_ADD(blocks_freed, 1);
+		block = next;
 	}
 
-	if (new_entry == NULL) {
+	dir.file_size[entry] = 0;
+	dir.reserved[entry] = 0;
+	dir.data_index[entry] = 0;
+	dir.block_count[entry] = 0;
+	dir.tail[entry] = FAT_EOC;
+	__atomic_store_n(&dir.open[entry], 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Populate the in-memory directory from the on-disk root directory. Return -1
+ * if out of memory.
+ */
+static int dir_load(void)
+{
+	struct Names *names = aligned_alloc(16, sizeof(struct Names));
+	if (names == NULL) {
 		return -1;
 	}
 
-	strncpy((char*)new_entry->filename, filename, FS_FILENAME_LEN);
-	new_entry->file_size = 0;
+	memset(&dir, 0, sizeof(dir));
+	memset(names, 0, sizeof(struct Names));
+	dir.names = names;
 
-	for (size_t i = 0; i < super.data_blocks; i++) {
-		if (fat.flat[i] == 0) {
-			fat.flat[i] = 0xFFFF;
-			new_entry->data_index = 0xFFFF;
-			break;
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir->entry[i].filename[0] == '\0') {
+			continue;
+		}
+		// copy up to the NULL character so that names stay zero-padded
+		size_t len = strnlen((char *)rootdir->entry[i].filename, FS_FILENAME_LEN);
+		memcpy(names->filename[i], rootdir->entry[i].filename, len);
+		dir.file_size[i] = rootdir->entry[i].file_size;
+		dir.reserved[i] = rootdir->entry[i].file_size;
+		dir.data_index[i] = rootdir->entry[i].data_index;
+		names->used[i / 64] |= 1ULL << (i % 64);
+
+		// walk the chain once to learn its length and last block
+		uint16_t block = dir.data_index[i];
+		dir.tail[i] = FAT_EOC;
+		while (block < super.data_blocks && dir.block_count[i] < super.data_blocks) {
+			dir.tail[i] = block;
+			dir.block_count[i]++;
+			block = fat.flat[block];
 		}
 	}
 
-	files.open++;
-
 	return 0;
 }
 
-int fs_delete(const char *filename)
+/* Serialize the in-memory directory back into the on-disk root directory */
+static void dir_flush(void)
 {
+	memset(rootdir, 0, sizeof(*rootdir));
+
 	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (memcmp(root.entry[i].filename, filename, FS_FILENAME_LEN) == 0) {
-			if (files.open == 0) {
-				fat.flat[root.entry[i].data_index] = 0x0000;
-				memset(&root.entry[i], 0, sizeof(struct Entry));
-				return 0;
-			} else {
-				return -1;
-			}
+		if (!(dir.names->used[i / 64] & (1ULL << (i % 64)))) {
+			continue;
 		}
+		memcpy(rootdir->entry[i].filename, dir.names->filename[i], FS_FILENAME_LEN);
+		rootdir->entry[i].file_size = dir.file_size[i];
+		rootdir->entry[i].data_index = dir.data_index[i];
 	}
-
-	return -1;
 }
 
-int fs_ls(void)
+/*
+ * Allocate the lowest free file descriptor for directory entry @entry, growing
+ * the table by one chunk if needed. Return -1 if the limit is reached. The
+ * caller must have pinned @entry with dir_pin().
+ */
+static int fd_alloc(int entry, uint16_t flags)
 {
-	printf("FS Ls:\n");
+	int fd = -1;
 
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root.entry[i].filename[0] != '\0') {
-			printf("file: %s, size: %" PRIu32 ", data_blk: %" PRIu16 "\n", root.entry[i].filename, root.entry[i].file_size, root.entry[i].data_index);
+	pthread_mutex_lock(&files.lock);
+
+	// find the first word of the bitmap with a free descriptor
+	for (size_t w = 0; w < FD_CHUNKS / 64; w++) {
+		if (files.summary[w]) {
+			size_t c = w * 64 + __builtin_ctzll(files.summary[w]);
+			fd = c * FD_CHUNK + __builtin_ctzll(files.free[c]);
+			break;
 		}
 	}
 
-	return 0;
-}
+	// no free descriptor, add a chunk unless the table is at its limit
+	if (fd == -1 && files.chunks < FD_CHUNKS && files.chunks * FD_CHUNK < files.limit) {
+		struct File *chunk = calloc(FD_CHUNK, sizeof(struct File));
+		if (chunk != NULL) {
+			size_t c = files.chunks;
+			files.free[c] = ~0ULL;
+			files.summary[c / 64] |= 1ULL << (c % 64);
+			__atomic_store_n(&files.chunk[c], chunk, __ATOMIC_RELEASE);
+			__atomic_store_n(&files.chunks, c + 1, __ATOMIC_RELEASE);
+			fd = c * FD_CHUNK;
+		}
+	}
 
-int fs_open(const char *filename)
-{
-	// return -1 if number of files open is max, full
-	if (files.open == FS_OPEN_MAX_COUNT) {
+	if (fd == -1 || (size_t)fd >= files.limit) {
+		pthread_mutex_unlock(&files.lock);
 		return -1;
 	}
-	// return -1 if invalid file
-	if (filename == NULL) {
-		return -1;
+
+	// claim the descriptor
+	size_t c = fd / FD_CHUNK;
+	files.free[c] &= ~(1ULL << (fd % FD_CHUNK));
+	if (files.free[c] == 0) {
+		files.summary[c / 64] &= ~(1ULL << (c % 64));
 	}
 
-	// iterate through files, look for a place for new file to be created
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (memcmp(root.entry[i].filename, filename, FS_FILENAME_LEN) == 0) {
-			//create new file to open
-			struct File *new_file = NULL;
-
-			// if the filename first character is \0, have new file map there
-			for (size_t j = 0; j < FS_OPEN_MAX_COUNT; j++) {
-				if (files.file[j].filename[0] == '\0') {
-					new_file = &files.file[j];
-					break;
-				}
-			}
+	struct File *file = &files.chunk[c][fd % FD_CHUNK];
+	file->entry = entry;
+	file->offset = 0;
+	file->cursor = CURSOR(0, FAT_EOC);
+	file->next = 0;
+	file->streak = 0;
+	file->advised = 0;
+	__atomic_store_n(&file->flags, FILE_OPEN | flags, __ATOMIC_RELEASE);
 
-			// return -1 if the new file is empty (opened nothing)
-			if (new_file == NULL) {
-				return -1;
-			}
+	files.open++;
 
-			// update new file's offset and filename to match target
-			strncpy((char *)new_file->filename, filename, FS_FILENAME_LEN);
-			new_file->offset = 0;
+	pthread_mutex_unlock(&files.lock);
 
-			// file successfully opened, increment number of files open
-			files.open++;
+	return fd;
+}
 
-			return 0;
-		}
-	}
+/* Release file descriptor @fd, which must be open */
+static void fd_free(int fd)
+{
+	size_t c = fd / FD_CHUNK;
+	struct File *file = &files.chunk[c][fd % FD_CHUNK];
 
-	return -1;
+	pthread_mutex_lock(&files.lock);
+
+	__atomic_fetch_sub(&dir.open[file->entry], 1, __ATOMIC_RELEASE);
+	files.open--;
+
+	__atomic_store_n(&file->flags, 0, __ATOMIC_RELEASE);
+	files.free[c] |= 1ULL << (fd % FD_CHUNK);
+	files.summary[c / 64] |= 1ULL << (c % 64);
+
+	pthread_mutex_unlock(&files.lock);
 }
 
-int fs_close(int fd)
+/* Return the state of file descriptor @fd, or NULL if it is not open */
+static struct File *fd_get(int fd)
 {
-	// return -1 if file descriptor invalid (out of bounds)
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
-		return -1;
+	// return NULL if file descriptor invalid (out of bounds)
+	if (fd < 0 || (size_t)fd >= __atomic_load_n(&files.chunks, __ATOMIC_ACQUIRE) * FD_CHUNK) {
+		return NULL;
 	}
-	// return -1 if file descriptor invalid (not open)
-	if (files.file[fd].filename[0] == '\0') {
-		return -1;
+
+	struct File *file = &files.chunk[fd / FD_CHUNK][fd % FD_CHUNK];
+
+	// return NULL if file descriptor invalid (not open)
+	if (!(__atomic_load_n(&file->flags, __ATOMIC_ACQUIRE) & FILE_OPEN)) {
+		return NULL;
 	}
 
-	// close the file
-	memset(&files.file[fd], 0, sizeof(struct File));
+	return file;
+}
 
-	// file successfully closed, decrement number of files open
-	files.open--;
+int fs_set_open_max(size_t max)
+{
+	if (max == 0 || max > FS_OPEN_LIMIT) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&files.lock);
+	files.limit = max;
+	pthread_mutex_unlock(&files.lock);
 
 	return 0;
 }
 
-int fs_stat(int fd)
+/*
+ * Return the data block holding byte @offset of @file, or FAT_EOC if @offset is
+ * past the end of the file's chain. The walk starts from the cursor when it is
+ * not beyond @offset, and leaves the cursor on the block it returns.
+ */
+static uint16_t file_block(struct File *file, size_t offset)
 {
-	// return -1 if file descriptor invalid (out of bounds)
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
-		return -1;
+	size_t index = offset / BLOCK_SIZE;
+	size_t i = 0;
+	uint16_t block = __atomic_load_n(&dir.data_index[file->entry], __ATOMIC_ACQUIRE);
+	uint32_t cursor = __atomic_load_n(&file->cursor, __ATOMIC_RELAXED);
+
+	if (CURSOR_BLOCK(cursor) != FAT_EOC && CURSOR_INDEX(cursor) <= index) {
+		i = CURSOR_INDEX(cursor);
+		block = CURSOR_BLOCK(cursor);
 	}
-	// return -1 if file descriptor invalid (not open)
-	if (files.file[fd].filename[0] == '\0') {
-		return -1;
+
+	// chains may be extended concurrently, links are published with release
+	while (i < index && block != FAT_EOC) {
+		block = __atomic_load_n(&fat.flat[block], __ATOMIC_ACQUIRE);
+		i++;
 	}
 
-	// return current file size of fd
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (memcmp(root.entry[i].filename, files.file[fd].filename, FS_FILENAME_LEN) == 0) {
-			return root.entry[i].file_size;
-		}
+	if (block != FAT_EOC) {
+		__atomic_store_n(&file->cursor, CURSOR(i, block), __ATOMIC_RELAXED);
 	}
 
-	// return -1 if invalid file descriptor, no match found
-	return -1;
+	return block;
 }
 
-int fs_lseek(int fd, size_t offset)
+/*
+ * Allocate a free data block and link it at the end of the chain of directory
+ * entry @entry. Return the new block, or FAT_EOC if the disk is full. Must be
+ * called with fs_lock held.
+ */
+static uint16_t fat_extend(int entry)
 {
-	// return -1 if file descriptor invalid (out of bounds)
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
-		return -1;
+	// first entry of the FAT is never a valid data block
+	for (size_t i = 1; i < super.data_blocks; i++) {
+		if (fat.flat[i] == 0) {
+			STATS_ADD(fat_entries_scanned, i);
+			STATS_ADD(blocks_allocated, 1);
+			PROBE2(block__alloc, entry, i);
+			fat.flat[i] = FAT_EOC;
+			fat_mark(i);
+			// link the block only once it is terminated, readers may be walking the chain
+			if (dir.tail[entry] == FAT_EOC) {
+				__atomic_store_n(&dir.data_index[entry], i, __ATOMIC_RELEASE);
+			} else {
+				__atomic_store_n(&fat.flat[dir.tail[entry]], i, __ATOMIC_RELEASE);
+				fat_mark(dir.tail[entry]);
+			}
+			dir.tail[entry] = i;
+			__atomic_store_n(&dir.block_count[entry], dir.block_count[entry] + 1, __ATOMIC_RELEASE);
+			return i;
+		}
 	}
-	// return -1 if file descriptor invalid (not open)
-	if (files.file[fd].filename[0] == '\0') {
-		return -1;
+	STATS_ADD(fat_entries_scanned, super.data_blocks - 1);
+
+	return FAT_EOC;
+}
+
+/*
+ * Write @size bytes from @buf at byte @offset of the file of directory entry
+ * @entry, within data block @block. Whole blocks are written directly, partial
+ * ones through a read-modify-write cycle under the block's lock.
+ */
+static int block_patch(int entry, uint16_t block, size_t offset, const void *buf, size_t size)
+{
+	uint8_t buffer[BLOCK_SIZE];
+	size_t block_offset = offset % BLOCK_SIZE;
+	size_t end = offset + size;
+	int ret;
+
+	if (size == BLOCK_SIZE) {
+		return blk_write(super.data_index + block, buf);
 	}
-	// return -1 if offset is larger than current file size
-	if (offset > root.entry[fd].file_size) {
-		return -1;
+
+	pthread_mutex_lock(&block_locks[block % BLOCK_LOCKS]);
+
+	/*
+	 * There is nothing to preserve if the bytes start the block and no data,
+	 * written or reserved by an appender, lies past them: zero the rest
+	 * instead of reading it. A writer that comes after us patches what we
+	 * wrote under the same lock, and one whose bytes overlap ours races
+	 * either way.
+	 */
+	if (block_offset == 0
+	    && __atomic_load_n(&dir.file_size[entry], __ATOMIC_ACQUIRE) < end
+	    && __atomic_load_n(&dir.reserved[entry], __ATOMIC_ACQUIRE) <= end) {
+		memcpy(buffer, buf, size);
+		memset(buffer + size, 0, BLOCK_SIZE - size);
+		ret = blk_write(super.data_index + block, buffer);
+		STATS_ADD(rmw_avoided, 1);
+	} else {
+		ret = blk_read(super.data_index + block, buffer);
+		if (ret == 0) {
+			memcpy(buffer + block_offset, buf, size);
+			ret = blk_write(super.data_index + block, buffer);
+		}
+		STATS_ADD(rmw_cycles, 1);
 	}
 
-	// set offset of file to argument given by function
-	files.file[fd].offset = offset;
+	pthread_mutex_unlock(&block_locks[block % BLOCK_LOCKS]);
 
-	return 0;
+	return ret;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+/* Atomically raise *@p to @value if it is smaller */
+static void atomic_max(uint32_t *p, uint32_t value)
 {
-	// return -1 if file descriptor invalid (out of bounds)
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
-		return -1;
-	}
-	// return -1 if file descriptor invalid (not open)
-	if (files.file[fd].filename[0] == '\0') {
-		return -1;
-	}
+	uint32_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
 
-	// create a new empty entry
-	struct Entry *entry = NULL;
+	while (cur < value && !__atomic_compare_exchange_n(p, &cur, value, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-	// set entry to be the specified entry through the function argument
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (memcmp(root.entry[i].filename, files.file[fd].filename, FS_FILENAME_LEN) == 0) {
-			entry = &root.entry[i];
+/*
+ * Append @count bytes from @buf to the file open as @file.
+ *
+ * The byte range is reserved by advancing dir.reserved with a compare-and-swap,
+ * which takes no lock as long as the range fits in the blocks already chained
+ * to the file. Only extending the chain is done under fs_lock, which the caller
+ * already holds if @locked is set. The data is then
+ * copied concurrently with other appenders, and the new size is published once
+ * every range reserved before ours has been, so readers never see a hole.
+ */
+static int append_write(struct File *file, const void *buf, size_t count, int locked)
+{
+	int entry = file->entry;
+	uint32_t start = __atomic_load_n(&dir.reserved[entry], __ATOMIC_ACQUIRE);
+	uint32_t end;
+	int ret = 0;
+
+	// fast path, the range fits in the allocated blocks
+	for (;;) {
+		size_t capacity = (size_t)__atomic_load_n(&dir.block_count[entry], __ATOMIC_ACQUIRE) * BLOCK_SIZE;
+		if (start + count > capacity) {
 			break;
 		}
+		end = start + count;
+		if (__atomic_compare_exchange_n(&dir.reserved[entry], &start, end, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			goto copy;
+		}
 	}
 
-	// return -1 if no file could be found with argument identifier
-	if (entry == NULL) {
-		return -1;
+	// slow path, extend the chain first and reserve as much as fits
+	if (!locked) {
+		pthread_mutex_lock(&fs_lock);
 	}
+	start = __atomic_load_n(&dir.reserved[entry], __ATOMIC_ACQUIRE);
+	do {
+		size_t want = start + count;
+		if (want > UINT32_MAX) {
+			want = UINT32_MAX;
+		}
+		while ((size_t)dir.block_count[entry] * BLOCK_SIZE < want && fat_extend(entry) != FAT_EOC);
 
-	// initialize writing, representing the number of bytes to be written to the file
-	size_t writing = count;
-	// store offset of argument file
-	size_t offset = files.file[fd].offset;
-
-	// write to file until no more bytes can be written
-	while (writing > 0) {
-		// set index and offset of block
-		size_t block_index = entry->data_index + offset / BLOCK_SIZE;
-		size_t block_offset = offset % BLOCK_SIZE;
-
-		// write_size used to determine amount of bytes to write to current block
-		size_t write_size = BLOCK_SIZE - block_offset;
-		if (write_size > writing) {
-			write_size = writing;
+		size_t capacity = (size_t)dir.block_count[entry] * BLOCK_SIZE;
+		end = want < capacity ? want : capacity;
+		if (end < start) {
+			end = start;
 		}
+	} while (!__atomic_compare_exchange_n(&dir.reserved[entry], &start, end, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	if (!locked) {
+		pthread_mutex_unlock(&fs_lock);
+	}
 
-		// allocate a buffer to read
-		void *buffer = (void*)malloc(BLOCK_SIZE);
+	// nothing reserved, the disk is full
+	if (end == start) {
+		return 0;
+	}
 
-		// return -1 if block_read returns -1, issue with the read
-		if (block_read(super.data_index + block_index, buffer) == -1) {
-			return -1;
+copy:
+	for (size_t offset = start; offset < end && ret == 0; ) {
+		size_t block_offset = offset % BLOCK_SIZE;
+		size_t write_size = BLOCK_SIZE - block_offset;
+		if (write_size > end - offset) {
+			write_size = end - offset;
 		}
 
-		// copy the data from the allocated buffer to the argument buffer
-		memcpy(buffer + block_offset, buf, write_size);
-
-		// write the buffer to the file system, return -1 if unable to do so
-		if (block_write(super.data_index + block_index, buffer) == -1) {
-			return -1;
+		uint16_t block = file_block(file, offset);
+		if (block == FAT_EOC || block_patch(entry, block, offset, buf, write_size) == -1) {
+			ret = -1;
 		}
 
-		// increment the offset and buffer by how many bytes were written, decrement writing by that amount (those bytes have been written, no longer need to be written)
 		offset += write_size;
 		buf += write_size;
-		writing -= write_size;
 	}
 
-	// update offset of file to match the new offset position
-	files.file[fd].offset = offset;
-
-	// if new offset is bigger than the file size, file size needs to be set to the new offset
-	if (offset > entry->file_size) {
-		entry->file_size = offset;
+	// publish in reservation order, even on error so later appenders are not stuck
+	while (__atomic_load_n(&dir.file_size[entry], __ATOMIC_ACQUIRE) < start) {
+		sched_yield();
 	}
+	atomic_max(&dir.file_size[entry], end);
 
-	// return number of bytes written to file
-	return count;
+	file->offset = end;
+
+	return ret == 0 ? (int)(end - start) : -1;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/* Transfer block @i of @t */
+static int transfer_block(struct Transfer *t, size_t i)
 {
-	// return -1 if file descriptor invalid (out of bounds)
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
-		return -1;
-	}
-	// return -1 if file descriptor invalid (not open)
-	if (files.file[fd].filename[0] == '\0') {
-		return -1;
+	uint8_t buffer[BLOCK_SIZE];
+	size_t block_offset = i == 0 ? t->offset : 0;
+	size_t pos = i == 0 ? 0 : i * BLOCK_SIZE - t->offset;
+	size_t size = BLOCK_SIZE - block_offset;
+	uint16_t block = t->blocks[i];
+
+	if (size > t->size - pos) {
+		size = t->size - pos;
 	}
 
-	// create a new empty entry
-	struct Entry *entry = NULL;
+	if (t->write) {
+		return block_patch(t->entry, block, (t->first + i) * BLOCK_SIZE + block_offset, t->buf + pos, size);
+	}
 
-	// set entry to be the specified entry through the function argument
-	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (memcmp(root.entry[i].filename, files.file[fd].filename/*, FS_FILENAME_LEN*/) == 0) {
-			entry = &root.entry[i];
-			break;
-		}
+	if (read_only) {
+		memcpy(t->buf + pos, (const uint8_t *)blk_data(super.data_index + block) + block_offset, size);
+		return 0;
 	}
 
-	// return -1 if no file could be found with argument identifier
-	if (entry == NULL) {
+	if (size == BLOCK_SIZE) {
+		return blk_read(super.data_index + block, t->buf + pos);
+	}
+	if (blk_read(super.data_index + block, buffer) == -1) {
 		return -1;
 	}
+	memcpy(t->buf + pos, buffer + block_offset, size);
 
-	// initialize reading, representing the number of bytes to be read from the file
-	size_t reading = count;
-	// store offset of argument file
-	size_t offset = files.file[fd].offset;
+	return 0;
+}
 
-	// check to see if offset is greater than the file size, indicating the end of the file (no more bytes to read, return 0)
-	if (offset >= entry->file_size) {
-		return 0;
+/* Pool job: transfer share @share of the blocks of the struct Transfer @arg */
+static void transfer_share(void *arg, size_t share)
+{
+	struct Transfer *t = arg;
+	size_t first = t->count * share / t->shares;
+	size_t last = t->count * (share + 1) / t->shares;
+
+	for (size_t i = first; i < last; i++) {
+		if (transfer_block(t, i) == -1) {
+			__atomic_store_n(&t->error, 1, __ATOMIC_RELAXED);
+			return;
+		}
 	}
+}
+
+/*
+ * Transfer @size bytes between @buf and byte @offset of the file open as @file,
+ * whose chain must already cover them. The data blocks are resolved up front,
+ * then split in contiguous shares that the worker pool transfers in parallel.
+ * Return @size, or -1 on error.
+ */
+static int file_transfer(struct File *file, void *buf, size_t size, size_t offset, int write)
+{
+	size_t first = offset / BLOCK_SIZE;
+	struct Transfer t = {
+		.entry = file->entry,
+		.first = first,
+		.count = (offset + size - 1) / BLOCK_SIZE - first + 1,
+		.offset = offset % BLOCK_SIZE,
+		.size = size,
+		.buf = buf,
+		.write = write,
+	};
+	uint16_t *blocks = NULL;
+
+	if (read_only) {
+		// the extents already list the blocks in order
+		t.blocks = &extents.extent[extents.first[file->entry] + first];
+	} else {
+		blocks = malloc(t.count * sizeof(uint16_t));
+		if (blocks == NULL) {
+			return -1;
+		}
+		blocks[0] = file_block(file, offset);
+		for (size_t i = 1; i < t.count && blocks[i - 1] != FAT_EOC; i++) {
+			blocks[i] = __atomic_load_n(&fat.flat[blocks[i - 1]], __ATOMIC_ACQUIRE);
+		}
+		if (blocks[t.count - 1] == FAT_EOC) {
+			free(blocks);
+			return -1;
+		}
+		t.blocks = blocks;
+
+		// leave the cursor at the end, where a sequential access continues
+		__atomic_store_n(&file->cursor, CURSOR(first + t.count - 1, blocks[t.count - 1]), __ATOMIC_RELAXED);
+	}
+
+	t.shares = t.count / PARALLEL_MIN_SHARE;
+	if (t.shares > pool_size() + 1) {
+		t.shares = pool_size() + 1;
+	}
+	if (t.shares == 0) {
+		t.shares = 1;
+	}
+	pool_run(transfer_share, &t, t.shares);
+
+	free(blocks);
+
+	return t.error ? -1 : (int)size;
+}
+
+/* Return whether a transfer of @size bytes at @offset is worth splitting */
+static int transfer_parallel(size_t size, size_t offset)
+{
+	return parallel_blocks && size && (offset + size - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1 >= parallel_blocks;
+}
+
+/* Return -1 if the super block does not describe a disk of @bcount blocks */
+static int super_check(int bcount)
+{
+	// minimum capacity for fat
+	uint8_t fat_min = (super.data_blocks * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	// return -1 if signature is not ECS150FS
+	if (memcmp("ECS150FS", super.signature, 8) != 0) {
+		return -1;
+	}
+	// return -1 if number of blocks in super does not match total blocks
+	if (super.fat_blocks + super.data_blocks != super.total_blocks - 2) {
+		return -1;
+	}
+	// return -1 if total blocks in super block does not match block disk count
+	if (super.total_blocks != bcount) {
+		return -1;
+	}
+	// return -1 if super block is not in the correct order
+	if (super.fat_blocks + 1 != super.root_index || super.root_index + 1 != super.data_index) {
+		return -1;
+	}
+	// return -1 if number of fat blocks is not equal to the min capacity
+	if (super.fat_blocks != fat_min) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Load the super block, the FAT and the root directory of the open disk.
+ * Return -1 if they do not hold a valid file system.
+ *
+ * With $FS_META_MMAP set to 1, a writable mount uses the FAT and the root
+ * directory in place, mapped privately from the disk, rather than copies read
+ * at mount. As with copies, changes only reach the disk when a commit writes
+ * back the modified blocks. Copies are used if the mapping fails.
+ */
+static int meta_load(void)
+{
+	const char *env = getenv("FS_PARALLEL_BLOCKS");
+	const char *mmap_env = getenv("FS_META_MMAP");
+
+	parallel_blocks = env ? strtoul(env, NULL, 0) : PARALLEL_BLOCKS;
+
+	// read super block
+	if (blk_read(0, &super) == -1 || super_check(blk_count()) == -1) {
+		return -1;
+	}
+
+	if (read_only) {
+		// use the FAT in place, it is never modified
+		fat.flat = (uint16_t *)blk_data(1);
+		if (blk_read(super.root_index, &root) == -1) {
+			return -1;
+		}
+	} else if (mmap_env && !strcmp(mmap_env, "1") &&
+		   (fat.flat = blk_map(1, super.fat_blocks + 1)) != NULL) {
+		// the root directory follows the fat in the mapping
+		rootdir = (struct RootDirectory *)((char *)fat.flat + super.fat_blocks * BLOCK_SIZE);
+		meta_mapped = 1;
+	} else {
+		// allocate fat, rounded up to whole blocks since it is written block by block
+		fat.flat = (uint16_t *)malloc(super.fat_blocks * BLOCK_SIZE);
+		if (fat.flat == NULL) {
+			return -1;
+		}
+
+		// the root directory follows the fat, read both with a single transfer
+		struct iovec iov[] = {
+			{ .iov_base = fat.flat, .iov_len = super.fat_blocks * BLOCK_SIZE },
+			{ .iov_base = &root, .iov_len = BLOCK_SIZE },
+		};
+		if (blk_readv(1, iov, 2) == -1) {
+			return -1;
+		}
+	}
+
+	// return -1 if first entry is not invalid entry (FFFF)
+	if (fat.flat[0] != 0xFFFF) {
+		return -1;
+	}
+	memset(fat.dirty, 0, sizeof(fat.dirty));
+
+	// build the in-memory directory from the root
+	return dir_load();
+}
+
+/* Free what meta_load() and extents_build() allocated */
+static void meta_release(void)
+{
+	if (meta_mapped) {
+		blk_unmap();
+		rootdir = &root;
+		meta_mapped = 0;
+	} else if (!read_only) {
+		free(fat.flat);
+	}
+	fat.flat = NULL;
+	free(dir.names);
+	dir.names = NULL;
+	free(extents.extent);
+	extents.extent = NULL;
+}
+
+/*
+ * Write the modified FAT blocks and the root directory back to the disk. Must be
+ * called with fs_lock held, or once nothing else uses the file system.
+ */
+static int meta_commit(void)
+{
+	size_t flushed = 0;
+
+	for (size_t i = 0; i < super.fat_blocks; i++) {
+		if (!(fat.dirty[i / 64] & (1ULL << (i % 64)))) {
+			continue;
+		}
+		if (meta_mapped) {
+			// write back the run of modified blocks from the mapping at once
+			size_t n = 1;
+			while (i + n < super.fat_blocks && (fat.dirty[(i + n) / 64] & (1ULL << ((i + n) % 64)))) {
+				n++;
+			}
+			if (blk_map_sync(i + 1, n) == -1) {
+				return -1;
+			}
+			for (size_t j = i; j < i + n; j++) {
+				fat.dirty[j / 64] &= ~(1ULL << (j % 64));
+			}
+			flushed += n;
+			i += n - 1;
+			continue;
+		}
+		if (blk_write(i + 1, fat.flat + (i * BLOCK_SIZE / 2)) == -1) {
+			return -1;
+		}
+		fat.dirty[i / 64] &= ~(1ULL << (i % 64));
+		flushed++;
+	}
+	PROBE1(meta__flush, flushed);
+
+	// rebuild the on-disk root directory from the in-memory one
+	dir_flush();
+
+	if (meta_mapped) {
+		return blk_map_sync(super.root_index, 1);
+	}
+	return blk_write(super.root_index, &root);
+}
+
+/*
+ * Resolve the data blocks of every file into extents, checking that chains stay
+ * within the disk, do not share blocks and are long enough for the file size.
+ * Return -1 if a chain is invalid.
+ */
+static int extents_build(void)
+{
+	uint8_t *seen = calloc(super.data_blocks, 1);
+	uint32_t n = 0;
+
+	extents.extent = malloc(super.data_blocks * sizeof(uint16_t));
+	if (seen == NULL || extents.extent == NULL) {
+		free(seen);
+		return -1;
+	}
+
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!(dir.names->used[i / 64] & (1ULL << (i % 64)))) {
+			continue;
+		}
+
+		extents.first[i] = n;
+		for (uint16_t block = dir.data_index[i]; block != FAT_EOC; block = fat.flat[block]) {
+			// out of bounds or already part of a chain
+			if (block == 0 || block >= super.data_blocks || seen[block]) {
+				free(seen);
+				return -1;
+			}
+			seen[block] = 1;
+			extents.extent[n++] = block;
+		}
+
+		// chain too short for the file size
+		if (dir.file_size[i] > (size_t)(n - extents.first[i]) * BLOCK_SIZE) {
+			free(seen);
+			return -1;
+		}
+	}
+
+	free(seen);
+
+	return 0;
+}
+
+/* What stopped the walk of a chain during a check */
+enum {
+	CHAIN_OK,
+	CHAIN_BAD,	/* block out of the data area, or loop */
+	CHAIN_CROSS,	/* block already part of another chain */
+};
+
+/*
+ * State of a check. owner[b] is 1 + the entry whose chain claimed data block b,
+ * 0 if no chain reached it. The chain of entry i was walked for length[i] valid
+ * blocks, the last of them being last[i] (FAT_EOC if none), before problem[i]
+ * stopped it.
+ */
+struct Check {
+	uint8_t *owner;
+	uint16_t length[FS_FILE_MAX_COUNT];
+	uint16_t last[FS_FILE_MAX_COUNT];
+	uint8_t problem[FS_FILE_MAX_COUNT];
+};
+
+/*
+ * Walk the chain of entry @entry, claiming its blocks. Every block is claimed
+ * once, so a walk ends even on a looping chain. Of two cross-linked chains, the
+ * one that claims the shared blocks first keeps them.
+ */
+static void check_chain(struct Check *c, int entry)
+{
+	uint8_t me = entry + 1;
+	uint16_t block = dir.data_index[entry];
+
+	c->length[entry] = 0;
+	c->last[entry] = FAT_EOC;
+	c->problem[entry] = CHAIN_OK;
+
+	while (block != FAT_EOC) {
+		uint8_t owner = 0;
+
+		if (block == 0 || block >= super.data_blocks) {
+			c->problem[entry] = CHAIN_BAD;
+			return;
+		}
+		if (!__atomic_compare_exchange_n(&c->owner[block], &owner, me, 0,
+						 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			c->problem[entry] = owner == me ? CHAIN_BAD : CHAIN_CROSS;
+			return;
+		}
+		c->last[entry] = block;
+		c->length[entry]++;
+		block = fat.flat[block];
+	}
+}
+
+/* Walk the chains of the entries of share @share of a parallel check */
+static void check_share(void *arg, size_t share)
+{
+	for (size_t i = share * CHECK_SHARE; i < (share + 1) * CHECK_SHARE; i++) {
+		if (dir.names->used[i / 64] & (1ULL << (i % 64))) {
+			check_chain(arg, i);
+		}
+	}
+}
+
+/*
+ * Free the blocks of entry @entry's walked chain beyond its first @keep ones and
+ * end the chain there. Must be called with fs_lock held, or once nothing else
+ * uses the file system.
+ */
+static void check_truncate(struct Check *c, int entry, size_t keep)
+{
+	uint16_t block = dir.data_index[entry];
+	uint16_t last = FAT_EOC;
+
+	for (size_t n = 0; n < keep; n++) {
+		last = block;
+		block = fat.flat[block];
+	}
+	if (last == FAT_EOC) {
+		dir.data_index[entry] = FAT_EOC;
+	} else {
+		fat.flat[last] = FAT_EOC;
+		fat_mark(last);
+	}
+
+	for (size_t n = keep; n < c->length[entry]; n++) {
+		uint16_t next = fat.flat[block];
+		fat.flat[block] = 0;
+		fat_mark(block);
+		c->owner[block] = 0;
+		block = next;
+	}
+	c->length[entry] = keep;
+}
+
+/*
+ * Check the loaded metadata, counting problems into @r, and fix them if
+ * @repair. Chains are cut at their first invalid or shared block, sizes are cut
+ * to their chains, blocks beyond what a file's size needs are freed, and so are
+ * allocated blocks no chain reaches. Return -1 if out of memory.
+ */
+static int check_run(int repair, struct fs_check_report *r)
+{
+	struct Check *c = malloc(sizeof(*c));
+	size_t allocated = 0;
+
+	memset(r, 0, sizeof(*r));
+	if (c == NULL || (c->owner = calloc(super.data_blocks, 1)) == NULL) {
+		free(c);
+		return -1;
+	}
+
+	for (size_t b = 1; b < super.data_blocks; b++) {
+		allocated += fat.flat[b] != 0;
+	}
+	if (allocated >= CHECK_PARALLEL_BLOCKS) {
+		pool_run(check_share, c, FS_FILE_MAX_COUNT / CHECK_SHARE);
+	} else {
+		for (size_t share = 0; share < FS_FILE_MAX_COUNT / CHECK_SHARE; share++) {
+			check_share(c, share);
+		}
+	}
+
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!(dir.names->used[i / 64] & (1ULL << (i % 64)))) {
+			continue;
+		}
+		size_t need = (dir.file_size[i] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+		r->files++;
+		if (c->problem[i] == CHAIN_BAD) {
+			r->bad_chains++;
+		} else if (c->problem[i] == CHAIN_CROSS) {
+			r->cross_links++;
+		} else if (c->length[i] != need) {
+			r->size_mismatches++;
+		}
+
+		if (!repair || (c->problem[i] == CHAIN_OK && c->length[i] == need)) {
+			continue;
+		}
+		check_truncate(c, i, need < c->length[i] ? need : c->length[i]);
+		if (dir.file_size[i] > (size_t)c->length[i] * BLOCK_SIZE) {
+			dir.file_size[i] = c->length[i] * BLOCK_SIZE;
+			dir.reserved[i] = dir.file_size[i];
+		}
+		r->repaired++;
+	}
+
+	// allocated blocks that no chain reaches
+	for (size_t b = 1; b < super.data_blocks; b++) {
+		if (fat.flat[b] == 0 || c->owner[b] != 0) {
+			continue;
+		}
+		r->leaked_blocks++;
+		if (repair) {
+			fat.flat[b] = 0;
+			fat_mark(b);
+			r->repaired++;
+		}
+	}
+
+	free(c->owner);
+	free(c);
+
+	return 0;
+}
+
+static int do_check(const char *diskname, int flags, struct fs_check_report *r)
+{
+	int problems = 0;
+
+	// return -1 on invalid arguments, or if a FS is mounted, its metadata would be replaced
+	if (r == NULL || (flags & ~(FS_CHECK_REPAIR | FS_CHECK_FORCE)) || fat.flat != NULL) {
+		return -1;
+	}
+
+	if (blk_open(diskname) == -1) {
+		return -1;
+	}
+	if (meta_load() == -1) {
+		meta_release();
+		blk_close();
+		return -1;
+	}
+
+	if (super.state == STATE_CLEAN && !(flags & FS_CHECK_FORCE)) {
+		memset(r, 0, sizeof(*r));
+		r->skipped = 1;
+	} else if (check_run(flags & FS_CHECK_REPAIR, r) == -1) {
+		problems = -1;
+	} else {
+		problems = r->bad_chains + r->cross_links + r->size_mismatches + r->leaked_blocks;
+
+		// only a repair writes, and a repaired image needs no check at the next mount
+		if (flags & FS_CHECK_REPAIR) {
+			super.state = STATE_CLEAN;
+			if ((r->repaired && meta_commit() == -1) || blk_write(0, &super) == -1) {
+				problems = -1;
+			}
+		}
+	}
+
+	meta_release();
+	blk_close();
+
+	return problems;
+}
+
+static int do_mount(const char *diskname)
+{
+	// return -1 if virtual disk file does not open
+	if (block_disk_open(diskname) == -1) {
+		return -1;
+	}
+	// blocks are transferred through a second, thread-safe descriptor
+	if (blk_open(diskname) == -1) {
+		block_disk_close();
+		return -1;
+	}
+
+	// return -1 if there is no valid file system on the disk
+	if (meta_load() == -1) {
+		meta_release();
+		blk_close();
+		block_disk_close();
+		return -1;
+	}
+
+	// warm the cache up while the check or the first calls run
+	blk_hints_load();
+
+	if (super.state == STATE_DIRTY) {
+		// following a broken or shared chain would corrupt other files
+		struct fs_check_report r;
+		if (check_run(0, &r) == -1 || r.bad_chains || r.cross_links) {
+			meta_release();
+			blk_close();
+			block_disk_close();
+			return -1;
+		}
+		// the others are harmless, but the image must stay dirty until repaired
+		check_needed = r.size_mismatches || r.leaked_blocks;
+	} else {
+		// clean, or never mounted by libfs and trusted like the images of
+		// other implementations, which fs_check() can still check. The image
+		// is about to change, until the next clean unmount
+		super.state = STATE_DIRTY;
+		if (blk_write(0, &super) == -1) {
+			meta_release();
+			blk_close();
+			block_disk_close();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int do_mount_ro(const char *diskname)
+{
+	// return -1 if virtual disk file cannot be mapped
+	if (blk_open_ro(diskname) == -1) {
+		return -1;
+	}
+
+	read_only = 1;
+
+	// return -1 if there is no valid file system on the disk
+	if (meta_load() == -1 || extents_build() == -1) {
+		meta_release();
+		blk_close();
+		read_only = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int do_umount(void)
+{
+	// return -1 if there are still open file descriptors
+	if (files.open != 0) {
+		return -1;
+	}
+
+	// nothing was modified on a read-only mount
+	if (read_only) {
+		meta_release();
+		read_only = 0;
+		return blk_close();
+	}
+
+	// write back the modified fat blocks and the root directory, return -1 if no mounted FS
+	if (fat.flat == NULL || meta_commit() == -1) {
+		return -1;
+	}
+
+	// then the super block, which marks the image clean only once the rest is written
+	super.state = check_needed ? STATE_DIRTY : STATE_CLEAN;
+	if (blk_write(0, &super) == -1) {
+		return -1;
+	}
+	check_needed = 0;
+
+	// hints are only an optimization, failing to save them is not an error
+	blk_hints_save();
+
+	meta_release();
+	blk_close();
+
+	// close virtual disk, return value returned by block_disk_close function
+	return block_disk_close();
+}
+
+static int do_statfs(struct fs_statfs *st)
+{
+	// return -1 if no FS is currently mounted
+	if (fat.flat == NULL || st == NULL) {
+		return -1;
+	}
+
+	st->total_blk_count = super.total_blocks;
+	st->fat_blk_count = super.fat_blocks;
+	st->rdir_blk = super.root_index;
+	st->data_blk = super.data_index;
+	st->data_blk_count = super.data_blocks;
+
+	// if fat array at index i is 0, there is a free block
+	st->fat_free = 0;
+	for (size_t i = 0; i < super.data_blocks; i++) {
+		if (fat.flat[i] == 0) {
+			st->fat_free++;
+		}
+	}
+
+	// every clear bit of the directory bitmap is a free entry
+	st->rdir_free = FS_FILE_MAX_COUNT;
+	int token = rcu_read_lock();
+	struct Names *names = names_get();
+	for (size_t w = 0; w < DIR_WORDS; w++) {
+		st->rdir_free -= __builtin_popcountll(names->used[w]);
+	}
+	rcu_read_unlock(token);
+
+	return 0;
+}
+
+static int do_info(void)
+{
+	struct fs_statfs st;
+
+	// return -1 if no FS is currently mounted
+	if (do_statfs(&st) == -1) {
+		return -1;
+	}
+
+	// print FS Info as follows
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n", st.total_blk_count);
+	printf("fat_blk_count=%u\n", st.fat_blk_count);
+	printf("rdir_blk=%u\n", st.rdir_blk);
+	printf("data_blk=%u\n", st.data_blk);
+	printf("data_blk_count=%u\n", st.data_blk_count);
+	printf("fat_free_ratio=%u/%u\n", st.fat_free, st.data_blk_count);
+	printf("rdir_free_ratio=%u/%d\n", st.rdir_free, FS_FILE_MAX_COUNT);
+
+	return 0;
+}
+
+static int do_create(const char *filename)
+{
+	uint8_t key[FS_FILENAME_LEN] __attribute__((aligned(16)));
+
+	// return -1 if filename is invalid or not correct length, or if mounted read-only
+	if (dir_key(filename, key) == -1 || read_only) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs_lock);
+
+	// return -1 if no FS is currently mounted
+	struct Names *names = dir.names == NULL ? NULL : names_copy();
+	if (names == NULL) {
+		pthread_mutex_unlock(&fs_lock);
+		return -1;
+	}
+
+	// return -1 if the file already exists or if the root directory is full
+	if (entry_create(names, names->used, key) == -1) {
+		pthread_mutex_unlock(&fs_lock);
+		free(names);
+		return -1;
+	}
+
+	// make the entry visible to lookups
+	names_publish(names);
+
+	pthread_mutex_unlock(&fs_lock);
+
+	return 0;
+}
+
+static int do_delete(const char *filename)
+{
+	uint8_t key[FS_FILENAME_LEN] __attribute__((aligned(16)));
+
+	// return -1 if filename is invalid, or if mounted read-only
+	if (dir_key(filename, key) == -1 || read_only) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs_lock);
+
+	// return -1 if no FS is currently mounted
+	struct Names *names = dir.names == NULL ? NULL : names_copy();
+	if (names == NULL) {
+		pthread_mutex_unlock(&fs_lock);
+		return -1;
+	}
+
+	// return -1 if there is no such file or if it is currently open
+	int i = entry_delete(names, key);
+	if (i == -1) {
+		pthread_mutex_unlock(&fs_lock);
+		free(names);
+		return -1;
+	}
+
+	// hide the entry from lookups, then free its blocks once nobody can find it
+	names_publish(names);
+	entry_release(i);
+
+	pthread_mutex_unlock(&fs_lock);
+
+	return 0;
+}
+
+static int do_readdir(struct fs_dirent *ents, size_t max)
+{
+	int count = 0;
+
+	int token = rcu_read_lock();
+	struct Names *names = names_get();
+
+	// return -1 if no FS is currently mounted
+	if (names == NULL) {
+		rcu_read_unlock(token);
+		return -1;
+	}
+
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!(names->used[i / 64] & (1ULL << (i % 64)))) {
+			continue;
+		}
+		if ((size_t)count < max) {
+			memcpy(ents[count].filename, names->filename[i], FS_FILENAME_LEN);
+			ents[count].size = __atomic_load_n(&dir.file_size[i], __ATOMIC_RELAXED);
+			ents[count].data_blk = __atomic_load_n(&dir.data_index[i], __ATOMIC_RELAXED);
+		}
+		count++;
+	}
+
+	rcu_read_unlock(token);
+
+	return count;
+}
+
+static int do_extents(const char *filename, struct fs_extent *ext, size_t max)
+{
+	uint8_t key[FS_FILENAME_LEN] __attribute__((aligned(16)));
+	int count = 0;
+
+	// return -1 if no FS is currently mounted, or if the name is invalid
+	if (fat.flat == NULL || dir_key(filename, key) == -1) {
+		return -1;
+	}
+
+	// chains only change with fs_lock held
+	pthread_mutex_lock(&fs_lock);
+
+	int entry = dir_find(dir.names, key);
+	if (entry == -1) {
+		pthread_mutex_unlock(&fs_lock);
+		return -1;
+	}
+
+	uint16_t block = dir.data_index[entry];
+	uint16_t prev = FAT_EOC;
+	for (size_t left = dir.block_count[entry]; left > 0 && block < super.data_blocks; left--) {
+		if (count > 0 && block == prev + 1) {
+			if ((size_t)count <= max) {
+				ext[count - 1].count++;
+			}
+		} else {
+			if ((size_t)count < max) {
+				ext[count].start = block;
+				ext[count].count = 1;
+			}
+			count++;
+		}
+		prev = block;
+		block = fat.flat[block];
+	}
+
+	pthread_mutex_unlock(&fs_lock);
+
+	return count;
+}
+
+static int do_ls(void)
+{
+	struct fs_dirent ents[FS_FILE_MAX_COUNT];
+
+	// return -1 if no FS is currently mounted
+	int count = do_readdir(ents, FS_FILE_MAX_COUNT);
+	if (count == -1) {
+		return -1;
+	}
+
+	printf("FS Ls:\n");
+
+	for (int i = 0; i < count; i++) {
+		printf("file: %s, size: %zu, data_blk: %u\n", ents[i].filename, ents[i].size, ents[i].data_blk);
+	}
+
+	return 0;
+}
+
+static int do_open_flags(const char *filename, int flags)
+{
+	uint8_t key[FS_FILENAME_LEN] __attribute__((aligned(16)));
+
+	// return -1 if invalid file or flags, appending needs a writable mount
+	if (dir_key(filename, key) == -1 || (flags & ~FS_O_APPEND) || (read_only && (flags & FS_O_APPEND))) {
+		return -1;
+	}
+
+	/*
+	 * Look the name up and pin the entry within one read-side section: an
+	 * entry that is pinned cannot be deleted, and one whose deletion has
+	 * started cannot be recycled for another file before the section ends.
+	 */
+	int token = rcu_read_lock();
+	struct Names *names = names_get();
+	int entry = names == NULL ? -1 : dir_find(names, key);
+	if (entry != -1 && dir_pin(entry) == -1) {
+		entry = -1;
+	}
+	rcu_read_unlock(token);
+
+	// return -1 if no FS is currently mounted, or if there is no file with that name
+	if (entry == -1) {
+		return -1;
+	}
+
+	// allocate the new file descriptor, -1 if too many files are open
+	int fd = fd_alloc(entry, flags & FS_O_APPEND ? FILE_APPEND : 0);
+	if (fd == -1) {
+		__atomic_fetch_sub(&dir.open[entry], 1, __ATOMIC_RELEASE);
+	}
+
+	return fd;
+}
+
+static int do_close(int fd)
+{
+	// return -1 if file descriptor invalid
+	if (fd_get(fd) == NULL) {
+		return -1;
+	}
+
+	// close the file
+	fd_free(fd);
+
+	return 0;
+}
+
+static int do_stat(int fd)
+{
+	// return -1 if file descriptor invalid
+	struct File *file = fd_get(fd);
+	if (file == NULL) {
+		return -1;
+	}
+
+	// return current file size of fd
+	return dir.file_size[file->entry];
+}
+
+static int do_lseek(int fd, size_t offset)
+{
+	// return -1 if file descriptor invalid
+	struct File *file = fd_get(fd);
+	if (file == NULL) {
+		return -1;
+	}
+	// return -1 if offset is larger than current file size
+	if (offset > dir.file_size[file->entry]) {
+		return -1;
+	}
+
+	// set offset of file to argument given by function
+	file->offset = offset;
+
+	return 0;
+}
+
+/*
+ * Write @count bytes from @buf to the file open as @file, at its offset or at
+ * its end if it is open for appending. Return the number of bytes written, or
+ * -1 on error. Chains are extended under fs_lock, which the caller already
+ * holds if @locked is set.
+ */
+static int file_write(struct File *file, const void *buf, size_t count, int locked)
+{
+	// appends reserve their own range at the end of the file
+	if (file->flags & FILE_APPEND) {
+		return append_write(file, buf, count, locked);
+	}
+
+	int entry = file->entry;
+
+	// initialize writing, representing the number of bytes to be written to the file
+	size_t writing = count;
+	// store offset of argument file
+	size_t offset = file->offset;
+
+	// large writes allocate all their blocks first, then write them in parallel
+	if (transfer_parallel(count, offset)) {
+		if (!locked) {
+			pthread_mutex_lock(&fs_lock);
+		}
+		while (dir.block_count[entry] <= (offset + count - 1) / BLOCK_SIZE && fat_extend(entry) != FAT_EOC);
+		if (!locked) {
+			pthread_mutex_unlock(&fs_lock);
+		}
+
+		// write as many bytes as the disk could hold, the loop below finds it full
+		size_t capacity = (size_t)dir.block_count[entry] * BLOCK_SIZE;
+		size_t size = capacity > offset ? capacity - offset : 0;
+		if (size > count) {
+			size = count;
+		}
+		if (size && file_transfer(file, (void *)buf, size, offset, 1) == -1) {
+			return -1;
+		}
+		offset += size;
+		buf += size;
+		writing -= size;
+	}
+
+	// write to file until no more bytes can be written
+	while (writing > 0) {
+		// find the block backing the offset, extending the file if needed
+		uint16_t block = file_block(file, offset);
+		if (block == FAT_EOC) {
+			if (!locked) {
+				pthread_mutex_lock(&fs_lock);
+			}
+			while (dir.block_count[entry] <= offset / BLOCK_SIZE && fat_extend(entry) != FAT_EOC);
+			if (!locked) {
+				pthread_mutex_unlock(&fs_lock);
+			}
+
+			// stop if the disk is full, writing as many bytes as possible
+			block = file_block(file, offset);
+			if (block == FAT_EOC) {
+				break;
+			}
+		}
+
+		size_t block_offset = offset % BLOCK_SIZE;
+
+		// write_size used to determine amount of bytes to write to current block
+		size_t write_size = BLOCK_SIZE - block_offset;
+		if (write_size > writing) {
+			write_size = writing;
+		}
+
+		// write the data to the file system, return -1 if unable to do so
+		if (block_patch(entry, block, offset, buf, write_size) == -1) {
+			return -1;
+		}
+
+		// increment the offset and buffer by how many bytes were written, decrement writing by that amount (those bytes have been written, no longer need to be written)
+		offset += write_size;
+		buf += write_size;
+		writing -= write_size;
+	}
+
+	// update offset of file to match the new offset position
+	file->offset = offset;
+
+	// if new offset is bigger than the file size, file size needs to be set to the new offset, and appends start after it
+	atomic_max(&dir.file_size[entry], offset);
+	atomic_max(&dir.reserved[entry], offset);
+
+	// return number of bytes written to file
+	return count - writing;
+}
+
+static int do_write(int fd, void *buf, size_t count)
+{
+	// return -1 if file descriptor invalid
+	struct File *file = fd_get(fd);
+	if (file == NULL) {
+		return -1;
+	}
+	// return -1 if buffer is invalid, or if mounted read-only
+	if (buf == NULL || read_only) {
+		return -1;
+	}
+
+	size_t offset = file->offset;
+	PROBE3(write__entry, fd, offset, count);
+	int written = file_write(file, buf, count, 0);
+	PROBE4(write__return, fd, offset, count, written);
+
+	return written;
+}
+
+/*
+ * Read up to @count bytes at byte @offset of the file open as @file into @buf.
+ * Return the number of bytes read, or -1 on error. On a read-only mount the
+ * blocks come from the extents and the mapping, so nothing shared is written
+ * and any number of threads can read at once.
+ */
+static int file_read(struct File *file, void *buf, size_t count, size_t offset)
+{
+	int entry = file->entry;
+	size_t file_size = __atomic_load_n(&dir.file_size[entry], __ATOMIC_ACQUIRE);
+	uint8_t buffer[BLOCK_SIZE];
+
+	// initialize reading, representing the number of bytes to be read from the file
+	size_t reading = count;
+
+	// check to see if offset is greater than the file size, indicating the end of the file (no more bytes to read, return 0)
+	if (offset >= file_size) {
+		return 0;
+	}
+
+	// update how many bytes we will read based on the offset, we can't read count bytes if the file is not large enough with the given offset
+	if (offset + count > file_size) {
+		reading = file_size - offset;
+	}
+	size_t total = reading;
+
+	// large reads resolve their blocks first, then read them in parallel
+	if (transfer_parallel(reading, offset)) {
+		return file_transfer(file, buf, reading, offset, 0);
+	}
+
+	// read through the file until no bytes left to read
+	while (reading > 0) {
+		size_t block_offset = offset % BLOCK_SIZE;
+
+		// read_size used to determine amount of bytes to read from current block
+		size_t read_size = BLOCK_SIZE - block_offset;
+
+		if (read_size > reading) {
+			read_size = reading;
+		}
+
+		if (read_only) {
+			// copy straight from the mapping
+			uint16_t block = extents.extent[extents.first[entry] + offset / BLOCK_SIZE];
+			memcpy(buf, (const uint8_t *)blk_data(super.data_index + block) + block_offset, read_size);
+		} else {
+			// find the block backing the offset
+			uint16_t block = file_block(file, offset);
+			if (block == FAT_EOC) {
+				return -1;
+			}
+
+			if (read_size == BLOCK_SIZE) {
+				// whole blocks, those that follow each other on the disk are
+				// read at once, straight into the argument buffer. The cache is
+				// only worth filling for a single block
+				size_t run = 1;
+				while ((run + 1) * BLOCK_SIZE <= reading &&
+				       file_block(file, offset + run * BLOCK_SIZE) == block + run) {
+					run++;
+				}
+				struct iovec iov = { .iov_base = buf, .iov_len = run * BLOCK_SIZE };
+				if (run == 1 ? blk_read(super.data_index + block, buf) == -1
+					     : blk_readv(super.data_index + block, &iov, 1) == -1) {
+					return -1;
+				}
+				read_size = run * BLOCK_SIZE;
+			} else {
+				// return -1 if blk_read returns -1, issue with the read
+				if (blk_read(super.data_index + block, buffer) == -1) {
+					return -1;
+				}
+
+				// copy the data from the block buffer to the argument buffer
+				memcpy(buf, buffer + block_offset, read_size);
+			}
+		}
+
+		// increment the offset and buffer by how many bytes were read, decrement reading by that amount (those bytes were read, no longer need to be read)
+		offset += read_size;
+		buf += read_size;
+		reading -= read_size;
+	}
+
+	// return number of bytes read from file
+	return total;
+}
+
+/*
+ * Pass @advice on for @count blocks of the file open as @file, from its block
+ * number @index, as few calls for as many runs of consecutive data blocks.
+ * Blocks past the end of the file are ignored.
+ */
+static int advise_range(struct File *file, size_t index, size_t count, int advice)
+{
+	int entry = file->entry;
+	size_t file_size = __atomic_load_n(&dir.file_size[entry], __ATOMIC_ACQUIRE);
+	size_t end = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint16_t block = FAT_EOC;
+	size_t start = 0, run = 0;
+	int ret = 0;
+
+	if (count > end || index > end - count) {
+		count = index < end ? end - index : 0;
+	}
+
+	if (!read_only && count > 0) {
+		// walk to the first block like file_block(), but leave the cursor
+		// where the reads need it
+		uint32_t cursor = __atomic_load_n(&file->cursor, __ATOMIC_RELAXED);
+		size_t i = 0;
+		block = __atomic_load_n(&dir.data_index[entry], __ATOMIC_ACQUIRE);
+		if (CURSOR_BLOCK(cursor) != FAT_EOC && CURSOR_INDEX(cursor) <= index) {
+			i = CURSOR_INDEX(cursor);
+			block = CURSOR_BLOCK(cursor);
+		}
+		while (i < index && block != FAT_EOC) {
+			block = __atomic_load_n(&fat.flat[block], __ATOMIC_ACQUIRE);
+			i++;
+		}
+	}
+
+	for (size_t i = index; i < index + count; i++) {
+		if (read_only) {
+			block = extents.extent[extents.first[entry] + i];
+		} else if (i > index && block != FAT_EOC) {
+			block = __atomic_load_n(&fat.flat[block], __ATOMIC_ACQUIRE);
+		}
+		if (block >= super.data_blocks) {
+			break;
+		}
 
-	// update how many bytes we will read based on the offset, we can't read count bytes if the file is not large enough with the given offset
-	if (offset + count > entry->file_size) {
-		reading = entry->file_size - offset;
+		if (run > 0 && block == start + run) {
+			run++;
+			continue;
+		}
+		if (run > 0 && blk_advise(super.data_index + start, run, advice) == -1) {
+			ret = -1;
+		}
+		start = block;
+		run = 1;
 	}
 
-	// read through the file until no bytes left to read
-	while (reading > 0) {
-		// set index and offset of block
-		size_t block_index = entry->data_index + offset / BLOCK_SIZE;
-		size_t block_offset = offset % BLOCK_SIZE;
+	if (run > 0 && blk_advise(super.data_index + start, run, advice) == -1) {
+		ret = -1;
+	}
 
-		// read_size used to determine amount of bytes to read from current block
-		size_t read_size = BLOCK_SIZE - block_offset;
+	return ret;
+}
 
-		if (read_size > reading) {
-			read_size = reading;
-		}
+/*
+ * Tell the host to read the next @window blocks of @file from its block number
+ * @index ahead, unless more than half of them were already announced.
+ */
+static void file_readahead(struct File *file, size_t index, size_t window)
+{
+	size_t advised = __atomic_load_n(&file->advised, __ATOMIC_RELAXED);
+	if (advised >= index + window / 2) {
+		return;
+	}
+
+	size_t end = index + window;
+	if (end > UINT16_MAX) {
+		end = UINT16_MAX;
+	}
+	size_t from = advised > index ? advised : index;
+	if (from >= end) {
+		return;
+	}
+	__atomic_store_n(&file->advised, end, __ATOMIC_RELAXED);
+	advise_range(file, from, end - from, BLK_ADV_WILLNEED);
+}
 
-		// allocate a buffer to read
-		void *buffer = (void*)malloc(BLOCK_SIZE);
+/*
+ * Account a read of @count bytes at byte @offset of @file. Once reads have
+ * followed each other ADVISE_STREAK times, or right away if the descriptor was
+ * advised %FS_ADV_SEQUENTIAL, the host is told to read the blocks of the file
+ * the next read will need ahead, at least ADVISE_WINDOW of them, and again
+ * whenever the reader gets halfway through them. The host's own read-ahead
+ * cannot do it since consecutive blocks of a file are not always consecutive
+ * in the image. Descriptors advised %FS_ADV_RANDOM are never read ahead.
+ */
+static void file_advise(struct File *file, size_t offset, size_t count)
+{
+	uint16_t flags = __atomic_load_n(&file->flags, __ATOMIC_RELAXED);
+	if (flags & FILE_RANDOM) {
+		return;
+	}
 
-		// return -1 if block_read returns -1, issue with the read
-		if (block_read(super.data_index + block_index, buffer) == -1) {
-			return -1;
+	uint32_t next = __atomic_exchange_n(&file->next, offset + count, __ATOMIC_RELAXED);
+	uint16_t streak = 0;
+	if (offset == next) {
+		streak = __atomic_load_n(&file->streak, __ATOMIC_RELAXED);
+		if (streak < ADVISE_STREAK) {
+			streak++;
+			__atomic_store_n(&file->streak, streak, __ATOMIC_RELAXED);
 		}
+	} else {
+		// a jump makes the announced blocks irrelevant
+		__atomic_store_n(&file->streak, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&file->advised, 0, __ATOMIC_RELAXED);
+	}
 
-		// copy the data from the allocated buffer to the argument buffer
-		memcpy(buf, buffer + block_offset, read_size);
+	if (streak < ADVISE_STREAK && !(flags & FILE_SEQUENTIAL)) {
+		return;
+	}
 
-		// increment the offset and buffer by how many bytes were read, decrement reading by that amount (those bytes were read, no longer need to be read)
-		offset += read_size;
-		buf += read_size;
-		reading -= read_size;
+	size_t window = count / BLOCK_SIZE > ADVISE_WINDOW ? count / BLOCK_SIZE : ADVISE_WINDOW;
+	file_readahead(file, (offset + count) / BLOCK_SIZE, window);
+}
+
+static int do_read(int fd, void *buf, size_t count)
+{
+	// return -1 if file descriptor invalid
+	struct File *file = fd_get(fd);
+	if (file == NULL) {
+		return -1;
+	}
+	// return -1 if buffer is invalid
+	if (buf == NULL) {
+		return -1;
 	}
 
+	size_t offset = file->offset;
+	PROBE3(read__entry, fd, offset, count);
+	int read = file_read(file, buf, count, offset);
+	PROBE4(read__return, fd, offset, count, read);
+
 	// update offset of file to match the new offset position
-	files.file[fd].offset = offset;
+	if (read > 0) {
+		file->offset += read;
+		file_advise(file, offset, read);
+	}
 
 	// return number of bytes read from file
-	return count - reading;
+	return read;
+}
+
+static int do_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	// return -1 if file descriptor invalid
+	struct File *file = fd_get(fd);
+	if (file == NULL) {
+		return -1;
+	}
+	// return -1 if buffer is invalid
+	if (buf == NULL) {
+		return -1;
+	}
+
+	PROBE3(read__entry, fd, offset, count);
+	int read = file_read(file, buf, count, offset);
+	PROBE4(read__return, fd, offset, count, read);
+
+	if (read > 0) {
+		file_advise(file, offset, read);
+	}
+
+	return read;
+}
+
+static int do_advise(int fd, size_t offset, size_t len, int advice)
+{
+	// return -1 if file descriptor invalid
+	struct File *file = fd_get(fd);
+	if (file == NULL) {
+		return -1;
+	}
+
+	switch (advice) {
+	case FS_ADV_NORMAL:
+		__atomic_fetch_and(&file->flags, ~(FILE_SEQUENTIAL | FILE_RANDOM), __ATOMIC_RELAXED);
+		return 0;
+	case FS_ADV_SEQUENTIAL:
+		__atomic_fetch_and(&file->flags, ~FILE_RANDOM, __ATOMIC_RELAXED);
+		__atomic_fetch_or(&file->flags, FILE_SEQUENTIAL, __ATOMIC_RELAXED);
+		// the first read is sequential too
+		file_readahead(file, file->offset / BLOCK_SIZE, ADVISE_WINDOW);
+		return 0;
+	case FS_ADV_RANDOM:
+		__atomic_fetch_and(&file->flags, ~FILE_SEQUENTIAL, __ATOMIC_RELAXED);
+		__atomic_fetch_or(&file->flags, FILE_RANDOM, __ATOMIC_RELAXED);
+		return 0;
+	case FS_ADV_WILLNEED:
+	case FS_ADV_DONTNEED:
+		break;
+	default:
+		return -1;
+	}
+
+	// a length of 0 extends to the end of the file
+	size_t index = offset / BLOCK_SIZE;
+	size_t count = SIZE_MAX - index;
+	if (len > 0 && len <= SIZE_MAX - 2 * BLOCK_SIZE) {
+		count = (offset % BLOCK_SIZE + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	}
+
+	return advise_range(file, index, count, advice == FS_ADV_WILLNEED ? BLK_ADV_WILLNEED : BLK_ADV_DONTNEED);
+}
+
+static int do_sync(void)
+{
+	// nothing is ever modified on a read-only mount
+	if (read_only) {
+		return fat.flat == NULL ? -1 : 0;
+	}
+
+	pthread_mutex_lock(&fs_lock);
+
+	// return -1 if no FS is currently mounted
+	int ret = fat.flat == NULL ? -1 : meta_commit();
+
+	pthread_mutex_unlock(&fs_lock);
+
+	return ret;
+}
+
+static int do_submit(struct fs_op *ops, size_t count)
+{
+	uint8_t key[FS_FILENAME_LEN] __attribute__((aligned(16)));
+	// entries that creates may not use: existing files and files deleted by the batch
+	uint64_t taken[DIR_WORDS];
+	uint64_t deleted[DIR_WORDS] = { 0 };
+	struct Names *names = NULL;
+	int last_fd = -1;
+	int ret = 0;
+
+	// return -1 if the batch is invalid
+	if (ops == NULL && count != 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs_lock);
+
+	// return -1 if no FS is currently mounted
+	if (dir.names == NULL) {
+		pthread_mutex_unlock(&fs_lock);
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		struct fs_op *op = &ops[i];
+		int fd = op->fd == FS_FD_LAST ? last_fd : op->fd;
+		struct File *file = NULL;
+
+		op->result = -1;
+
+		switch (op->op) {
+		case FS_OP_CREATE:
+		case FS_OP_DELETE:
+			if (dir_key(op->filename, key) == -1 || read_only) {
+				break;
+			}
+			// directory changes go to one private copy, published at the end
+			if (names == NULL) {
+				names = names_copy();
+				if (names == NULL) {
+					break;
+				}
+				memcpy(taken, names->used, sizeof(taken));
+			}
+			if (op->op == FS_OP_CREATE) {
+				int entry = entry_create(names, taken, key);
+				if (entry != -1) {
+					taken[entry / 64] |= 1ULL << (entry % 64);
+					op->result = 0;
+				}
+			} else {
+				int entry = entry_delete(names, key);
+				if (entry != -1) {
+					deleted[entry / 64] |= 1ULL << (entry % 64);
+					op->result = 0;
+				}
+			}
+			break;
+
+		case FS_OP_OPEN: {
+			if (dir_key(op->filename, key) == -1 || (op->flags & ~FS_O_APPEND) || (read_only && (op->flags & FS_O_APPEND))) {
+				break;
+			}
+			// holding fs_lock, the entry cannot be deleted or recycled under us
+			int entry = dir_find(names ? names : dir.names, key);
+			if (entry == -1 || dir_pin(entry) == -1) {
+				break;
+			}
+			op->result = fd_alloc(entry, op->flags & FS_O_APPEND ? FILE_APPEND : 0);
+			if (op->result == -1) {
+				__atomic_fetch_sub(&dir.open[entry], 1, __ATOMIC_RELEASE);
+			}
+			last_fd = op->result;
+			break;
+		}
+
+		case FS_OP_CLOSE:
+			if (fd_get(fd) != NULL) {
+				fd_free(fd);
+				op->result = 0;
+			}
+			break;
+
+		case FS_OP_WRITE:
+			file = fd_get(fd);
+			if (file != NULL && op->buf != NULL && !read_only) {
+				op->result = file_write(file, op->buf, op->count, 1);
+			}
+			break;
+
+		case FS_OP_READ:
+			file = fd_get(fd);
+			if (file != NULL && op->buf != NULL) {
+				op->result = file_read(file, op->buf, op->count, file->offset);
+				if (op->result > 0) {
+					file->offset += op->result;
+				}
+			}
+			break;
+		}
+	}
+
+	// one grace period for the whole batch, then free what it deleted
+	if (names != NULL) {
+		names_publish(names);
+		for (size_t w = 0; w < DIR_WORDS; w++) {
+			for (uint64_t bits = deleted[w]; bits; bits &= bits - 1) {
+				entry_release(w * 64 + __builtin_ctzll(bits));
+			}
+		}
+	}
+
+	// commit the metadata once
+	if (!read_only && meta_commit() == -1) {
+		ret = -1;
+	}
+
+	pthread_mutex_unlock(&fs_lock);
+
+	return ret;
+}
+
+/*
+ * Public entry points. Each one times, counts (see stats.h) and records (see
+ * record.h) its call, then runs the implementation above.
+ */
+
+/* Set the name of @rec to @filename, if recording is on */
+static void record_name(struct fs_record *rec, const char *filename)
+{
+	if (filename && record_on()) {
+		// too long names are left unterminated
+		strncpy(rec->filename, filename, FS_FILENAME_LEN);
+	}
+}
+
+/* Set the descriptor of @rec to @fd, and its offset to @fd's if recording is on */
+static void record_fd(struct fs_record *rec, int fd)
+{
+	rec->fd = fd;
+	if (record_on()) {
+		struct File *file = fd_get(fd);
+		rec->offset = file ? file->offset : 0;
+	}
+}
+
+/*
+ * Time, count and record @call, whose result is an int, as operation @stat, with
+ * the arguments in struct fs_record @rec. @bytes is the amount of data the call
+ * moved, and can use its result, ret.
+ */
+#define STATS_CALL(stat, call, bytes, rec)	\
+({											\
+	uint64_t _start = stats_start();		\
+	int ret = (call);						\
+	stats_end(stat, _start, ret, (bytes));	\
+	if (record_on()) {						\
+		(rec)->time = _start;				\
+		(rec)->op = stat;					\
+		(rec)->ret = ret;					\
+		record_call(rec);					\
+	}										\
+	ret;									\
+})
+
+int fs_mount(const char *diskname)
+{
+	struct fs_record rec = { .fd = -1 };
+
+	return STATS_CALL(FS_STAT_MOUNT, do_mount(diskname), 0, &rec);
+}
+
+int fs_mount_ro(const char *diskname)
+{
+	struct fs_record rec = { .fd = -1 };
+
+	return STATS_CALL(FS_STAT_MOUNT, do_mount_ro(diskname), 0, &rec);
+}
+
+int fs_umount(void)
+{
+	struct fs_record rec = { .fd = -1 };
+	int ret = STATS_CALL(FS_STAT_UMOUNT, do_umount(), 0, &rec);
+
+	trace_flush();
+	record_flush();
+
+	return ret;
+}
+
+int fs_statfs(struct fs_statfs *st)
+{
+	struct fs_record rec = { .fd = -1 };
+
+	return STATS_CALL(FS_STAT_STATFS, do_statfs(st), 0, &rec);
+}
+
+int fs_info(void)
+{
+	struct fs_record rec = { .fd = -1 };
+
+	return STATS_CALL(FS_STAT_INFO, do_info(), 0, &rec);
+}
+
+int fs_create(const char *filename)
+{
+	struct fs_record rec = { .fd = -1 };
+
+	record_name(&rec, filename);
+	return STATS_CALL(FS_STAT_CREATE, do_create(filename), 0, &rec);
+}
+
+int fs_delete(const char *filename)
+{
+	struct fs_record rec = { .fd = -1 };
+
+	record_name(&rec, filename);
+	return STATS_CALL(FS_STAT_DELETE, do_delete(filename), 0, &rec);
+}
+
+int fs_readdir(struct fs_dirent *ents, size_t max)
+{
+	struct fs_record rec = { .fd = -1, .count = max };
+
+	return STATS_CALL(FS_STAT_READDIR, do_readdir(ents, max), 0, &rec);
+}
+
+int fs_extents(const char *filename, struct fs_extent *ext, size_t max)
+{
+	struct fs_record rec = { .fd = -1, .count = max };
+
+	record_name(&rec, filename);
+	return STATS_CALL(FS_STAT_EXTENTS, do_extents(filename, ext, max), 0, &rec);
+}
+
+int fs_check(const char *diskname, int flags, struct fs_check_report *report)
+{
+	struct fs_record rec = { .fd = -1, .flags = flags };
+
+	return STATS_CALL(FS_STAT_CHECK, do_check(diskname, flags, report), 0, &rec);
+}
+
+int fs_ls(void)
+{
+	struct fs_record rec = { .fd = -1 };
+
+	return STATS_CALL(FS_STAT_LS, do_ls(), 0, &rec);
+}
+
+int fs_open(const char *filename)
+{
+	struct fs_record rec = { .fd = -1 };
+
+	record_name(&rec, filename);
+	return STATS_CALL(FS_STAT_OPEN, do_open_flags(filename, 0), 0, &rec);
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	struct fs_record rec = { .fd = -1, .flags = flags };
+
+	record_name(&rec, filename);
+	return STATS_CALL(FS_STAT_OPEN, do_open_flags(filename, flags), 0, &rec);
+}
+
+int fs_close(int fd)
+{
+	struct fs_record rec = { .fd = fd };
+
+	return STATS_CALL(FS_STAT_CLOSE, do_close(fd), 0, &rec);
+}
+
+int fs_stat(int fd)
+{
+	struct fs_record rec = { .fd = fd };
+
+	return STATS_CALL(FS_STAT_STAT, do_stat(fd), 0, &rec);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	struct fs_record rec = { .fd = fd, .offset = offset };
+
+	return STATS_CALL(FS_STAT_LSEEK, do_lseek(fd, offset), 0, &rec);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	struct fs_record rec = { .count = count };
+
+	record_fd(&rec, fd);
+	return STATS_CALL(FS_STAT_WRITE, do_write(fd, buf, count), ret > 0 ? ret : 0, &rec);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	struct fs_record rec = { .count = count };
+
+	record_fd(&rec, fd);
+	return STATS_CALL(FS_STAT_READ, do_read(fd, buf, count), ret > 0 ? ret : 0, &rec);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	struct fs_record rec = { .fd = fd, .offset = offset, .count = count };
+
+	return STATS_CALL(FS_STAT_PREAD, do_pread(fd, buf, count, offset), ret > 0 ? ret : 0, &rec);
+}
+
+int fs_advise(int fd, size_t offset, size_t len, int advice)
+{
+	struct fs_record rec = { .fd = fd, .offset = offset, .count = len, .flags = advice };
+
+	return STATS_CALL(FS_STAT_ADVISE, do_advise(fd, offset, len, advice), 0, &rec);
+}
+
+int fs_sync(void)
+{
+	struct fs_record rec = { .fd = -1 };
+
+	return STATS_CALL(FS_STAT_SYNC, do_sync(), 0, &rec);
+}
+
+/* Record the operations of batch @ops, submitted at @start, one by one */
+static void record_batch(struct fs_op *ops, size_t count, uint64_t start)
+{
+	static const int16_t stat_op[] = {
+		[FS_OP_CREATE] = FS_STAT_CREATE,
+		[FS_OP_DELETE] = FS_STAT_DELETE,
+		[FS_OP_OPEN] = FS_STAT_OPEN,
+		[FS_OP_CLOSE] = FS_STAT_CLOSE,
+		[FS_OP_WRITE] = FS_STAT_WRITE,
+		[FS_OP_READ] = FS_STAT_READ,
+	};
+	int last_fd = -1;
+
+	for (size_t i = 0; i < count; i++) {
+		struct fs_op *op = &ops[i];
+		struct fs_record rec = { .time = start, .ret = op->result };
+
+		if (op->op < FS_OP_CREATE || op->op > FS_OP_READ) {
+			continue;
+		}
+		rec.op = stat_op[op->op];
+		rec.fd = op->fd == FS_FD_LAST ? last_fd : op->fd;
+		switch (op->op) {
+		case FS_OP_CREATE:
+		case FS_OP_DELETE:
+			record_name(&rec, op->filename);
+			break;
+		case FS_OP_OPEN:
+			record_name(&rec, op->filename);
+			rec.fd = -1;
+			rec.flags = op->flags;
+			last_fd = op->result;
+			break;
+		case FS_OP_WRITE:
+		case FS_OP_READ:
+			rec.count = op->count;
+			break;
+		}
+		record_call(&rec);
+	}
+}
+
+int fs_submit(struct fs_op *ops, size_t count)
+{
+	uint64_t start = stats_start();
+	int ret = do_submit(ops, count);
+
+	stats_end(FS_STAT_SUBMIT, start, ret, 0);
+	if (ops && record_on()) {
+		record_batch(ops, count, start);
+	}
+
+	return ret;
+}
+
+int fs_stats(struct fs_stats *st)
+{
+	if (st == NULL) {
+		return -1;
+	}
+
+	stats_collect(st);
+
+	return 0;
+}
+
+int fs_stats_thread(struct fs_stats *st)
+{
+	if (st == NULL) {
+		return -1;
+	}
+
+	stats_thread(st);
+
+	return 0;
 }
@@ -0,0 +1,470 @@
+#ifndef _FS_EXT_H
+#define _FS_EXT_H
+
+/*
+ * Extensions to the fs.h API. fs.h is the frozen interface of the project, so
+ * everything libfs offers beyond it is declared here.
+ *
+ * Setting $FS_RECORD to a file name records every call into it, as a struct
+ * fs_record_header followed by one struct fs_record per call, which
+ * apps/replay.x plays back.
+ *
+ * An fs_read(), fs_pread() or fs_write() spanning at least $FS_PARALLEL_BLOCKS
+ * blocks (256 by default, 0 disables it), read at mount time, resolves its data
+ * blocks up front and transfers them on $FS_PARALLEL_THREADS worker threads.
+ *
+ * Setting $FS_EMU, e.g. to "hdd" or "ssd", makes every block transfer that
+ * misses the block cache take the time it would on such a device, read when
+ * the disk is mounted. fs_stats() then counts the emulated device's seeks, the
+ * blocks they crossed, the bytes it moved and the time it was busy. See
+ * libfs/emu.h for the settings.
+ *
+ * Setting $FS_META_MMAP to 1 makes fs_mount() map the FAT and the root
+ * directory from the disk instead of reading copies of them. The mapping is
+ * private, so the disk still only changes when the metadata is committed.
+ *
+ * Setting $FS_CACHE_HINTS to 1 makes fs_umount() record the blocks in the
+ * block cache to a "<diskname>.hot" file, and fs_mount() prefetch them in the
+ * background, so that the first reads after a remount hit the cache.
+ *
+ * Reads that follow each other on a descriptor make libfs advise the host to
+ * read the next blocks of the file ahead, see fs_advise().
+ */
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+#include "fs.h"
+
+/** Upper bound for the runtime limit on open files */
+#define FS_OPEN_LIMIT 65536
+
+/** fs_open_flags() flag: every write appends to the end of the file */
+#define FS_O_APPEND 0x1
+
+/** Operations of a batch submitted with fs_submit() */
+enum {
+	FS_OP_CREATE,	/* fs_create(@filename) */
+	FS_OP_DELETE,	/* fs_delete(@filename) */
+	FS_OP_OPEN,	/* fs_open_flags(@filename, @flags) */
+	FS_OP_CLOSE,	/* fs_close(@fd) */
+	FS_OP_WRITE,	/* fs_write(@fd, @buf, @count) */
+	FS_OP_READ,	/* fs_read(@fd, @buf, @count) */
+};
+
+/** fs_op.fd value standing for the descriptor of the batch's latest open */
+#define FS_FD_LAST (-2)
+
+/** One operation of a batch, @result is set to what the matching call returns */
+struct fs_op {
+	int op;
+	const char *filename;
+	int flags;
+	int fd;
+	void *buf;
+	size_t count;
+	int result;
+};
+
+/** Operations counted by fs_stats(), block_* are transfers of single blocks */
+enum {
+	FS_STAT_MOUNT,
+	FS_STAT_UMOUNT,
+	FS_STAT_INFO,
+	FS_STAT_STATFS,
+	FS_STAT_CREATE,
+	FS_STAT_DELETE,
+	FS_STAT_LS,
+	FS_STAT_READDIR,
+	FS_STAT_OPEN,
+	FS_STAT_CLOSE,
+	FS_STAT_STAT,
+	FS_STAT_LSEEK,
+	FS_STAT_WRITE,
+	FS_STAT_READ,
+	FS_STAT_PREAD,
+	FS_STAT_SUBMIT,
+	FS_STAT_SYNC,
+	FS_STAT_EXTENTS,
+	FS_STAT_CHECK,
+	FS_STAT_ADVISE,
+	FS_STAT_BLOCK_READ,
+	FS_STAT_BLOCK_WRITE,
+	FS_STAT_OP_COUNT
+};
+
+/** Number of buckets of a latency histogram, see fs_stats_bucket_ns() */
+#define FS_STATS_BUCKETS 336
+
+/** Counters of one operation */
+struct fs_op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t hist[FS_STATS_BUCKETS];
+};
+
+/** Counters returned by fs_stats(), all of them uint64_t */
+struct fs_stats {
+	struct fs_op_stats op[FS_STAT_OP_COUNT];
+	/* Block cache */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_evictions;
+	uint64_t cache_prefetched;
+	/* Data block allocator */
+	uint64_t blocks_allocated;
+	uint64_t blocks_freed;
+	uint64_t fat_entries_scanned;
+	/* Partial-block writes */
+	uint64_t rmw_cycles;
+	uint64_t rmw_avoided;
+	/* Emulated device of $FS_EMU, see below */
+	uint64_t emu_seeks;
+	uint64_t emu_seek_blocks;
+	uint64_t emu_bytes_read;
+	uint64_t emu_bytes_written;
+	uint64_t emu_busy_ns;
+};
+
+/** Magic number opening a file recorded with $FS_RECORD */
+#define FS_RECORD_MAGIC "FSREC01"
+
+/** Header of a file recorded with $FS_RECORD, followed by struct fs_record */
+struct fs_record_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+/**
+ * One call recorded with $FS_RECORD. @offset is the offset of fs_pread() and
+ * fs_lseek(), and the descriptor's offset before fs_read() and fs_write(), 0
+ * for the calls of an fs_submit() batch, which are recorded one by one. @count
+ * is the byte count of transfers and the @max of fs_readdir() and
+ * fs_extents(). fs_advise() records its range in @offset and @count, and its
+ * advice in @flags. A @filename that does not fit is recorded unterminated.
+ */
+struct fs_record {
+	uint64_t time;	/* Start of the call, CLOCK_MONOTONIC nanoseconds */
+	uint64_t offset;
+	uint64_t count;
+	uint32_t tid;	/* Thread that made the call */
+	int16_t op;	/* One of the FS_STAT_* operations */
+	int16_t flags;	/* Flags of fs_open_flags() and fs_check(), advice of fs_advise() */
+	int32_t fd;
+	int32_t ret;
+	char filename[FS_FILENAME_LEN];
+};
+
+/** File system information returned by fs_statfs() */
+struct fs_statfs {
+	unsigned int total_blk_count;
+	unsigned int fat_blk_count;
+	unsigned int rdir_blk;
+	unsigned int data_blk;
+	unsigned int data_blk_count;
+	unsigned int fat_free;
+	unsigned int rdir_free;
+};
+
+/** Directory entry returned by fs_readdir() */
+struct fs_dirent {
+	char filename[FS_FILENAME_LEN];
+	size_t size;
+	unsigned int data_blk;
+};
+
+/**
+ * fs_mount_ro - Mount a file system read-only
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as fs_mount(), but the virtual disk file is opened read-only and mapped
+ * in memory, so processes mounting the same image share the host page cache.
+ * The metadata is validated once at mount, including every file's chain, and
+ * nothing is written back by fs_umount(). fs_create(), fs_delete(), fs_write()
+ * and opening with %FS_O_APPEND fail on a read-only mount.
+ *
+ * Reads do not take any lock: any number of threads can call fs_pread() at
+ * once, on the same or on different descriptors.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened or mapped, or if
+ * no valid file system can be located. 0 otherwise.
+ */
+int fs_mount_ro(const char *diskname);
+
+/**
+ * fs_statfs - Get information about file system
+ * @st: Filled with the information displayed by fs_info()
+ *
+ * Return: -1 if no FS is currently mounted or if @st is NULL. 0 otherwise.
+ */
+int fs_statfs(struct fs_statfs *st);
+
+/**
+ * fs_readdir - Get the files on file system
+ * @ents: Array of at least @max entries
+ * @max: Number of entries that fit in @ents
+ *
+ * Fill @ents with the files located in the root directory, in the order
+ * fs_ls() lists them, stopping after @max files.
+ *
+ * Return: -1 if no FS is currently mounted. Otherwise the number of files in
+ * the root directory, which can be larger than @max.
+ */
+int fs_readdir(struct fs_dirent *ents, size_t max);
+
+/** Run of consecutive data blocks of a file, returned by fs_extents() */
+struct fs_extent {
+	unsigned int start;	/* First data block, numbered like fs_dirent.data_blk */
+	unsigned int count;
+};
+
+/**
+ * fs_extents - Get the layout of a file
+ * @filename: File name
+ * @ext: Array of at least @max extents
+ * @max: Number of extents that fit in @ext
+ *
+ * Walk the chain of data blocks of file @filename and fill @ext with its runs
+ * of consecutive blocks, in file order, stopping after @max runs.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no file named
+ * @filename. Otherwise the number of extents of the file, which can be larger
+ * than @max, 0 if it has no data block.
+ */
+int fs_extents(const char *filename, struct fs_extent *ext, size_t max);
+
+/** fs_check() flag: fix the problems found */
+#define FS_CHECK_REPAIR 0x1
+/** fs_check() flag: check the image even if it was unmounted cleanly */
+#define FS_CHECK_FORCE 0x2
+
+/** Problems found by fs_check() */
+struct fs_check_report {
+	unsigned int files;
+	unsigned int bad_chains;	/* Chains leaving the data area or looping */
+	unsigned int cross_links;	/* Chains running into another file's chain */
+	unsigned int size_mismatches;	/* Valid chains not as long as the file size needs */
+	unsigned int leaked_blocks;	/* Allocated blocks that no chain reaches */
+	unsigned int repaired;
+	int skipped;			/* Set if the image was clean and not checked */
+};
+
+/**
+ * fs_check - Check the consistency of a file system
+ * @diskname: Name of the virtual disk file, which must not be mounted
+ * @flags: %FS_CHECK_REPAIR and %FS_CHECK_FORCE
+ * @report: Filled with the problems found
+ *
+ * Walk the chain of every file, on the worker threads for large images, and
+ * check that chains stay in the data area, do not loop, do not share blocks and
+ * are as long as the file sizes need, and that every allocated block belongs to
+ * a chain. With %FS_CHECK_REPAIR, chains are cut at their first invalid or
+ * shared block, sizes are cut to their chains, and blocks beyond what a file's
+ * size needs and leaked blocks are freed. Of two cross-linked files, which one
+ * keeps the shared blocks is unspecified.
+ *
+ * fs_umount() marks the image clean, and mounting it for writing marks it
+ * dirty again. A clean image is not checked unless %FS_CHECK_FORCE is set.
+ * fs_mount() checks dirty images, i.e. images that were not unmounted cleanly,
+ * without repairing them, and fails on bad or cross-linked chains. Images that
+ * libfs never mounted for writing, e.g. made by fs_make.x, are neither clean
+ * nor dirty: fs_mount() trusts them, and fs_check() checks them.
+ *
+ * Without %FS_CHECK_REPAIR, the image is only read: a dirty image stays dirty,
+ * even if consistent. With it, the repaired image is marked clean.
+ *
+ * Return: -1 if a file system is mounted, if @diskname cannot be opened or
+ * holds no valid file system, or if @flags is invalid. Otherwise the number of
+ * problems found, 0 for a consistent or skipped image.
+ */
+int fs_check(const char *diskname, int flags, struct fs_check_report *report);
+
+/**
+ * fs_set_open_max - Set the maximum number of open files
+ * @max: New limit
+ *
+ * Change how many files can be open simultaneously. The limit defaults to
+ * %FS_OPEN_MAX_COUNT. The descriptor table grows on demand up to @max, so
+ * raising the limit costs nothing until descriptors are actually used.
+ * Lowering it below the number of currently open files only prevents further
+ * opens.
+ *
+ * Return: -1 if @max is 0 or larger than %FS_OPEN_LIMIT. 0 otherwise.
+ */
+int fs_set_open_max(size_t max);
+
+/**
+ * fs_open_flags - Open a file with flags
+ * @filename: File name
+ * @flags: Bitwise OR of open flags
+ *
+ * Same as fs_open(), with @flags changing how the file is accessed.
+ *
+ * With %FS_O_APPEND, each fs_write() writes its whole buffer at the current end
+ * of the file, regardless of the file offset, and leaves the offset just past
+ * the written data. Threads appending to the same file concurrently each get
+ * their own contiguous byte range and copy their data in parallel. The file
+ * size only grows past a range once all ranges before it have been written.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename to open, or if @flags is invalid, or if the
+ * open file limit is reached. Otherwise, return the file descriptor.
+ */
+int fs_open_flags(const char *filename, int flags);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but reads at @offset and leaves the file offset of @fd
+ * untouched, so that several threads can share a descriptor.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/** Access patterns and needs of fs_advise() */
+enum {
+	/* No particular pattern, the default */
+	FS_ADV_NORMAL,
+	/* Reads are mostly sequential: read ahead from the first one */
+	FS_ADV_SEQUENTIAL,
+	/* Reads are random: never read ahead */
+	FS_ADV_RANDOM,
+	/* The range will be read soon */
+	FS_ADV_WILLNEED,
+	/* The range will not be read again soon */
+	FS_ADV_DONTNEED,
+};
+
+/**
+ * fs_advise - Tell how a file will be read
+ * @fd: File descriptor
+ * @offset: Start of the range, for %FS_ADV_WILLNEED and %FS_ADV_DONTNEED
+ * @len: Length of the range, 0 for up to the end of the file
+ * @advice: One of the FS_ADV_* values
+ *
+ * %FS_ADV_NORMAL, %FS_ADV_SEQUENTIAL and %FS_ADV_RANDOM set the access pattern
+ * of @fd, which otherwise starts reading the blocks of its file ahead once a
+ * few reads have followed each other. %FS_ADV_WILLNEED asks the host's page
+ * cache to read the blocks of the range ahead, and %FS_ADV_DONTNEED to drop
+ * them, e.g. once a one-shot scan is done with them, so that it does not evict
+ * blocks that are used again. The block cache is left alone.
+ *
+ * Return: -1 if file descriptor @fd is invalid, if @advice is invalid, or if
+ * the host rejects the advice. 0 otherwise.
+ */
+int fs_advise(int fd, size_t offset, size_t len, int advice);
+
+/**
+ * fs_sync - Write the file system metadata back to disk
+ *
+ * Write the FAT blocks modified since the last commit and the root directory,
+ * as fs_umount() does, without unmounting. File data is always written through
+ * and needs no syncing.
+ *
+ * Return: -1 if no FS is currently mounted, or if the metadata cannot be
+ * written. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_submit - Execute a batch of operations
+ * @ops: Array of @count operations
+ * @count: Number of operations
+ *
+ * Execute the operations of @ops in order and set each one's result to what
+ * the matching fs_*() call would have returned; a failed operation does not
+ * stop the batch. An operation whose @fd is %FS_FD_LAST uses the descriptor
+ * returned by the latest %FS_OP_OPEN before it, so that a batch can create,
+ * open, write and close files without a round trip per file.
+ *
+ * The whole batch runs under a single acquisition of the file system lock,
+ * files created and deleted by it become visible all at once, and the metadata
+ * is committed once at the end as with fs_sync(). Bulk ingestion of many small
+ * files should go through here rather than through separate calls.
+ *
+ * Return: -1 if no FS is currently mounted, or if @ops is NULL, or if the
+ * metadata cannot be committed. 0 otherwise.
+ */
+int fs_submit(struct fs_op *ops, size_t count);
+
+/**
+ * fs_stats - Get the library's counters
+ * @st: Filled with the counters
+ *
+ * Report, since the process started, the number of calls, errors, bytes
+ * transferred and a latency histogram of every operation, along with block
+ * cache, allocator and partial-write counters. Every thread counts into its
+ * own set of counters, which this sums. Collection is on unless $FS_STATS is
+ * set to 0, in which case every counter stays 0.
+ *
+ * Return: -1 if @st is NULL. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *st);
+
+/**
+ * fs_stats_thread - Get the calling thread's counters
+ * @st: Filled with the counters
+ *
+ * Same as fs_stats(), but only counting the calls the calling thread made, and
+ * the block transfers it issued itself.
+ *
+ * Return: -1 if @st is NULL, or if the calls are not made in this process, as
+ * with the fsd client stub. 0 otherwise.
+ */
+int fs_stats_thread(struct fs_stats *st);
+
+/**
+ * fs_stats_name - Get the name of an operation
+ * @op: One of the FS_STAT_* operations
+ *
+ * Return: NULL if @op is invalid, otherwise the name of the operation.
+ */
+const char *fs_stats_name(int op);
+
+/**
+ * fs_stats_bucket_ns - Get the range of a histogram bucket
+ * @bucket: Index of the bucket, below %FS_STATS_BUCKETS
+ *
+ * Latencies below 8ns have a bucket each, and every further power of two is
+ * split in 8 buckets, so values are recorded with at most 12.5% error.
+ *
+ * Return: The smallest latency, in nanoseconds, counted in @bucket.
+ */
+uint64_t fs_stats_bucket_ns(size_t bucket);
+
+/**
+ * fs_stats_percentile - Get a latency percentile of an operation
+ * @op: Counters of the operation
+ * @q: Fraction of the calls, between 0 and 1
+ *
+ * Return: 0 if the operation was never called, otherwise the latency in
+ * nanoseconds, rounded down to its histogram bucket, that a fraction @q of
+ * the calls did not exceed.
+ */
+uint64_t fs_stats_percentile(const struct fs_op_stats *op, double q);
+
+/**
+ * fs_trace_dump - Write the trace of recent calls
+ * @path: File to write, or NULL for $FS_TRACE
+ *
+ * When $FS_TRACE is set, every call counted by fs_stats() is also recorded with
+ * its start and end time, in a ring of the last $FS_TRACE_EVENTS calls (16384
+ * by default) per thread. fs_umount() dumps them to $FS_TRACE, and this dumps
+ * them on demand, in the Chrome Trace Event format that Perfetto and
+ * chrome://tracing open. Each thread gets its own track, with block transfers
+ * nested in the calls that issued them.
+ *
+ * Return: -1 if tracing is off, or if @path cannot be written. 0 otherwise.
+ */
+int fs_trace_dump(const char *path);
+
+#endif /* _FS_EXT_H */
@@ -0,0 +1,79 @@
+#ifndef _FSD_H
+#define _FSD_H
+
+/*
+ * Protocol between the fsd daemon (apps/fsd.c) and the client stub
+ * (fsd_client.c), which implements the fs.h API on top of it.
+ *
+ * The daemon mounts a disk and serves it on a SOCK_SEQPACKET Unix socket named
+ * $FSD_SOCKET, or the disk name followed by %FSD_SOCKET_SUFFIX. A client
+ * connects and sends a %FSD_HELLO batch carrying a memfd of %FSD_SHM_SIZE bytes
+ * (as SCM_RIGHTS ancillary data) that both sides map. File data is exchanged
+ * through that shared buffer, never through the socket.
+ *
+ * Every message is a batch: a struct fsd_batch followed by @count requests. The
+ * daemon executes them in order and answers with @count struct fsd_rsp. A batch
+ * flagged %FSD_BATCH_SUBMIT is executed with fs_submit() instead, and answered
+ * with the fs_submit() result followed by the @count per-request results.
+ */
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/** Suffix appended to the disk name to get the default socket name */
+#define FSD_SOCKET_SUFFIX ".sock"
+
+/** Size of the buffer shared between a client and the daemon */
+#define FSD_SHM_SIZE (1 << 20)
+
+/** Maximum number of requests in a batch */
+#define FSD_BATCH_MAX 1024
+
+/* Operations */
+enum {
+	FSD_HELLO,	/* Attach the shared buffer */
+	FSD_BYE,	/* Detach, fails if the client still has open files */
+	FSD_CREATE,	/* fs_create(@name) */
+	FSD_DELETE,	/* fs_delete(@name) */
+	FSD_OPEN,	/* fs_open_flags(@name, @offset) */
+	FSD_CLOSE,	/* fs_close(@fd) */
+	FSD_STAT,	/* fs_stat(@fd) */
+	FSD_LSEEK,	/* fs_lseek(@fd, @offset) */
+	FSD_WRITE,	/* fs_write(@fd, shared buffer + @shm, @count) */
+	FSD_READ,	/* fs_read(@fd, shared buffer + @shm, @count) */
+	FSD_PREAD,	/* fs_pread(@fd, shared buffer + @shm, @count, @offset) */
+	FSD_STATFS,	/* fs_statfs() into shared buffer + @shm */
+	FSD_READDIR,	/* fs_readdir() of @count entries into shared buffer + @shm */
+	FSD_SYNC,	/* fs_sync() */
+	FSD_STATS,	/* fs_stats() of the daemon into shared buffer + @shm */
+	FSD_EXTENTS,	/* fs_extents(@name) of @count extents into shared buffer + @shm */
+	FSD_ADVISE,	/* fs_advise(@fd, @offset, @count, @shm), @shm is the advice */
+};
+
+/* Batch flag: execute the batch as one fs_submit() */
+#define FSD_BATCH_SUBMIT 0x1
+
+/* One request */
+struct fsd_req {
+	uint32_t op;
+	int32_t fd;
+	uint64_t offset;
+	uint64_t count;
+	uint64_t shm;
+	char name[FS_FILENAME_LEN];
+};
+
+/* Header of a batch of requests */
+struct fsd_batch {
+	uint32_t count;
+	uint32_t flags;
+	struct fsd_req req[];
+};
+
+/* Result of one request, the return value of the matching fs_* call */
+struct fsd_rsp {
+	int64_t ret;
+};
+
+#endif /* _FSD_H */
@@ -0,0 +1,560 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "fs_ext.h"
+#include "fsd.h"
+
+/*
+ * Client stub of the fsd daemon: implements the fs.h API, plus the fs_ext.h
+ * calls that make sense remotely, by forwarding every call to the daemon
+ * serving the disk. Link with libfsclient.a instead of libfs.a.
+ *
+ * Calls are serialized on the connection, so threads can share it.
+ */
+
+#define fsd_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Connection to the daemon */
+static struct {
+	/* Socket, -1 when not mounted */
+	int sock;
+	/* Buffer shared with the daemon */
+	char *shm;
+	/* Held across a request and the use of the shared buffer it implies */
+	pthread_mutex_t lock;
+} conn = { .sock = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Send the @count requests of @batch, and fill @rsp with their results (see
+ * %FSD_BATCH_SUBMIT for the layout of submitted batches). Return -1 if the
+ * daemon cannot be reached. Must be called with conn.lock held.
+ */
+static int fsd_call(struct fsd_batch *batch, struct fsd_rsp *rsp)
+{
+	size_t len = sizeof(*batch) + batch->count * sizeof(struct fsd_req);
+
+	if (send(conn.sock, batch, len, 0) != (ssize_t)len) {
+		perror("send");
+		return -1;
+	}
+
+	len = (batch->count + (batch->flags & FSD_BATCH_SUBMIT ? 1 : 0)) * sizeof(struct fsd_rsp);
+	if (recv(conn.sock, rsp, len, 0) != (ssize_t)len) {
+		fsd_error("lost connection to fsd");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Execute a single request, return its result or -1. Must be called with conn.lock held. */
+static int64_t fsd_call1_locked(struct fsd_req *req)
+{
+	struct {
+		struct fsd_batch batch;
+		struct fsd_req req;
+	} msg = { .batch = { .count = 1 }, .req = *req };
+	struct fsd_rsp rsp;
+
+	if (conn.sock == -1) {
+		return -1;
+	}
+
+	if (fsd_call(&msg.batch, &rsp) == -1) {
+		return -1;
+	}
+
+	return rsp.ret;
+}
+
+/* Execute a single request that does not use the shared buffer */
+static int64_t fsd_call1(struct fsd_req *req)
+{
+	pthread_mutex_lock(&conn.lock);
+	int64_t ret = fsd_call1_locked(req);
+	pthread_mutex_unlock(&conn.lock);
+
+	return ret;
+}
+
+/* Execute a request naming a file */
+static int fsd_name_call(uint32_t op, const char *filename, uint64_t arg)
+{
+	struct fsd_req req = { .op = op, .offset = arg };
+
+	if (filename == NULL || strlen(filename) >= FS_FILENAME_LEN) {
+		return -1;
+	}
+	strcpy(req.name, filename);
+
+	return fsd_call1(&req);
+}
+
+int fs_mount(const char *diskname)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *path = getenv("FSD_SOCKET");
+	int shm_fd;
+
+	if (conn.sock != -1 || diskname == NULL) {
+		return -1;
+	}
+
+	if (path) {
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	} else {
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s%s", diskname, FSD_SOCKET_SUFFIX);
+	}
+
+	conn.sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (conn.sock < 0) {
+		perror("socket");
+		conn.sock = -1;
+		return -1;
+	}
+	if (connect(conn.sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("connect");
+		goto error;
+	}
+
+	/* Shared buffer, handed over to the daemon with the hello */
+	shm_fd = memfd_create("fsd", MFD_CLOEXEC);
+	if (shm_fd < 0 || ftruncate(shm_fd, FSD_SHM_SIZE)) {
+		perror("memfd");
+		goto error;
+	}
+	conn.shm = mmap(NULL, FSD_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	if (conn.shm == MAP_FAILED) {
+		perror("mmap");
+		close(shm_fd);
+		conn.shm = NULL;
+		goto error;
+	}
+
+	struct {
+		struct fsd_batch batch;
+		struct fsd_req req;
+	} msg = { .batch = { .count = 1 }, .req = { .op = FSD_HELLO } };
+	char control[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+
+	struct fsd_rsp rsp;
+	if (sendmsg(conn.sock, &mh, 0) != sizeof(msg)
+	    || recv(conn.sock, &rsp, sizeof(rsp), 0) != sizeof(rsp)
+	    || rsp.ret != 0) {
+		fsd_error("fsd refused connection");
+		close(shm_fd);
+		goto error;
+	}
+	close(shm_fd);
+
+	return 0;
+
+error:
+	if (conn.shm) {
+		munmap(conn.shm, FSD_SHM_SIZE);
+		conn.shm = NULL;
+	}
+	close(conn.sock);
+	conn.sock = -1;
+	return -1;
+}
+
+/* The daemon decides how the disk is mounted, connecting is all there is to do */
+int fs_mount_ro(const char *diskname)
+{
+	return fs_mount(diskname);
+}
+
+int fs_umount(void)
+{
+	struct fsd_req req = { .op = FSD_BYE };
+
+	/* The daemon refuses if files are still open */
+	if (fsd_call1(&req) != 0) {
+		return -1;
+	}
+
+	munmap(conn.shm, FSD_SHM_SIZE);
+	conn.shm = NULL;
+	close(conn.sock);
+	conn.sock = -1;
+
+	return 0;
+}
+
+int fs_statfs(struct fs_statfs *st)
+{
+	struct fsd_req req = { .op = FSD_STATFS };
+	int ret = -1;
+
+	if (st == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&conn.lock);
+	if (fsd_call1_locked(&req) == 0) {
+		memcpy(st, conn.shm, sizeof(*st));
+		ret = 0;
+	}
+	pthread_mutex_unlock(&conn.lock);
+
+	return ret;
+}
+
+int fs_info(void)
+{
+	struct fs_statfs st;
+
+	if (fs_statfs(&st) == -1) {
+		return -1;
+	}
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n", st.total_blk_count);
+	printf("fat_blk_count=%u\n", st.fat_blk_count);
+	printf("rdir_blk=%u\n", st.rdir_blk);
+	printf("data_blk=%u\n", st.data_blk);
+	printf("data_blk_count=%u\n", st.data_blk_count);
+	printf("fat_free_ratio=%u/%u\n", st.fat_free, st.data_blk_count);
+	printf("rdir_free_ratio=%u/%d\n", st.rdir_free, FS_FILE_MAX_COUNT);
+
+	return 0;
+}
+
+int fs_readdir(struct fs_dirent *ents, size_t max)
+{
+	struct fsd_req req = { .op = FSD_READDIR, .count = FS_FILE_MAX_COUNT };
+
+	pthread_mutex_lock(&conn.lock);
+	int count = fsd_call1_locked(&req);
+	if (count >= 0) {
+		if ((size_t)count < max) {
+			max = count;
+		}
+		memcpy(ents, conn.shm, max * sizeof(struct fs_dirent));
+	}
+	pthread_mutex_unlock(&conn.lock);
+
+	return count;
+}
+
+int fs_extents(const char *filename, struct fs_extent *ext, size_t max)
+{
+	struct fsd_req req = { .op = FSD_EXTENTS, .count = FSD_SHM_SIZE / sizeof(struct fs_extent) };
+
+	if (filename == NULL || strlen(filename) >= FS_FILENAME_LEN) {
+		return -1;
+	}
+	strcpy(req.name, filename);
+
+	pthread_mutex_lock(&conn.lock);
+	int count = fsd_call1_locked(&req);
+	if (count >= 0) {
+		if ((size_t)count < max) {
+			max = count;
+		}
+		memcpy(ext, conn.shm, max * sizeof(struct fs_extent));
+	}
+	pthread_mutex_unlock(&conn.lock);
+
+	return count;
+}
+
+/* The daemon keeps its disk mounted, which cannot be checked meanwhile */
+int fs_check(const char *diskname, int flags, struct fs_check_report *report)
+{
+	(void)diskname;
+	(void)flags;
+	(void)report;
+
+	return -1;
+}
+
+int fs_ls(void)
+{
+	struct fs_dirent ents[FS_FILE_MAX_COUNT];
+	int count = fs_readdir(ents, FS_FILE_MAX_COUNT);
+
+	if (count == -1) {
+		return -1;
+	}
+
+	printf("FS Ls:\n");
+	for (int i = 0; i < count; i++) {
+		printf("file: %s, size: %zu, data_blk: %u\n", ents[i].filename, ents[i].size, ents[i].data_blk);
+	}
+
+	return 0;
+}
+
+int fs_create(const char *filename)
+{
+	return fsd_name_call(FSD_CREATE, filename, 0);
+}
+
+int fs_delete(const char *filename)
+{
+	return fsd_name_call(FSD_DELETE, filename, 0);
+}
+
+int fs_open(const char *filename)
+{
+	return fsd_name_call(FSD_OPEN, filename, 0);
+}
+
+/* The daemon serves up to FS_OPEN_LIMIT open files whatever the client asks */
+int fs_set_open_max(size_t max)
+{
+	if (max == 0 || max > FS_OPEN_LIMIT) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	return fsd_name_call(FSD_OPEN, filename, flags);
+}
+
+int fs_close(int fd)
+{
+	struct fsd_req req = { .op = FSD_CLOSE, .fd = fd };
+
+	return fsd_call1(&req);
+}
+
+int fs_stat(int fd)
+{
+	struct fsd_req req = { .op = FSD_STAT, .fd = fd };
+
+	return fsd_call1(&req);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	struct fsd_req req = { .op = FSD_LSEEK, .fd = fd, .offset = offset };
+
+	return fsd_call1(&req);
+}
+
+/*
+ * Transfer @count bytes between @buf and the file, going through the shared
+ * buffer one buffer-full at a time.
+ */
+static int fsd_transfer(uint32_t op, int fd, void *buf, size_t count, size_t offset)
+{
+	size_t done = 0;
+
+	if (buf == NULL) {
+		return -1;
+	}
+
+	do {
+		size_t chunk = count - done < FSD_SHM_SIZE ? count - done : FSD_SHM_SIZE;
+		struct fsd_req req = {
+			.op = op,
+			.fd = fd,
+			.offset = offset + done,
+			.count = chunk,
+		};
+
+		pthread_mutex_lock(&conn.lock);
+		if (op == FSD_WRITE && conn.shm) {
+			memcpy(conn.shm, (char *)buf + done, chunk);
+		}
+		int64_t ret = fsd_call1_locked(&req);
+		if (op != FSD_WRITE && ret > 0) {
+			memcpy((char *)buf + done, conn.shm, ret);
+		}
+		pthread_mutex_unlock(&conn.lock);
+
+		if (ret < 0) {
+			return done ? (int)done : -1;
+		}
+		done += ret;
+
+		/* Short transfer, end of file or disk full */
+		if ((size_t)ret < chunk) {
+			break;
+		}
+	} while (done < count);
+
+	return done;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	return fsd_transfer(FSD_WRITE, fd, buf, count, 0);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	return fsd_transfer(FSD_READ, fd, buf, count, 0);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	return fsd_transfer(FSD_PREAD, fd, buf, count, offset);
+}
+
+int fs_advise(int fd, size_t offset, size_t len, int advice)
+{
+	struct fsd_req req = { .op = FSD_ADVISE, .fd = fd, .offset = offset, .count = len };
+
+	// the advice travels in the buffer offset, which the daemon bounds
+	if (advice < FS_ADV_NORMAL || advice > FS_ADV_DONTNEED) {
+		return -1;
+	}
+	req.shm = advice;
+
+	return fsd_call1(&req);
+}
+
+int fs_sync(void)
+{
+	struct fsd_req req = { .op = FSD_SYNC };
+
+	return fsd_call1(&req);
+}
+
+/*
+ * The batch travels as a single message, so it is limited to %FSD_BATCH_MAX
+ * operations whose data fits in the shared buffer; larger batches fail whole.
+ */
+int fs_submit(struct fs_op *ops, size_t count)
+{
+	static const uint32_t op_of[] = {
+		[FS_OP_CREATE] = FSD_CREATE,
+		[FS_OP_DELETE] = FSD_DELETE,
+		[FS_OP_OPEN] = FSD_OPEN,
+		[FS_OP_CLOSE] = FSD_CLOSE,
+		[FS_OP_WRITE] = FSD_WRITE,
+		[FS_OP_READ] = FSD_READ,
+	};
+	static struct {
+		struct fsd_batch batch;
+		struct fsd_req req[FSD_BATCH_MAX];
+	} msg;
+	static struct fsd_rsp rsp[FSD_BATCH_MAX + 1];
+	size_t shm = 0;
+
+	if (ops == NULL && count != 0) {
+		return -1;
+	}
+	for (size_t i = 0; i < count; i++) {
+		ops[i].result = -1;
+	}
+	if (count > FSD_BATCH_MAX) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&conn.lock);
+	if (conn.sock == -1) {
+		pthread_mutex_unlock(&conn.lock);
+		return -1;
+	}
+
+	// lay the data of writes and the space for reads out in the shared buffer
+	for (size_t i = 0; i < count; i++) {
+		struct fs_op *op = &ops[i];
+		struct fsd_req *req = &msg.req[i];
+
+		if (op->op < FS_OP_CREATE || op->op > FS_OP_READ) {
+			pthread_mutex_unlock(&conn.lock);
+			return -1;
+		}
+
+		memset(req, 0, sizeof(*req));
+		req->op = op_of[op->op];
+		req->fd = op->fd;
+		req->offset = op->flags;
+		if (op->filename) {
+			if (strlen(op->filename) >= FS_FILENAME_LEN) {
+				// invalid names fail on the daemon side like locally
+				req->name[0] = '\0';
+			} else {
+				strcpy(req->name, op->filename);
+			}
+		}
+
+		if (op->op == FS_OP_WRITE || op->op == FS_OP_READ) {
+			if (op->buf == NULL || op->count > FSD_SHM_SIZE - shm) {
+				pthread_mutex_unlock(&conn.lock);
+				return -1;
+			}
+			req->shm = shm;
+			req->count = op->count;
+			if (op->op == FS_OP_WRITE) {
+				memcpy(conn.shm + shm, op->buf, op->count);
+			}
+			shm += op->count;
+		}
+	}
+
+	msg.batch.count = count;
+	msg.batch.flags = FSD_BATCH_SUBMIT;
+	if (fsd_call(&msg.batch, rsp) == -1) {
+		pthread_mutex_unlock(&conn.lock);
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		ops[i].result = rsp[i + 1].ret;
+		if (ops[i].op == FS_OP_READ && ops[i].result > 0) {
+			memcpy(ops[i].buf, conn.shm + msg.req[i].shm, ops[i].result);
+		}
+	}
+	pthread_mutex_unlock(&conn.lock);
+
+	return rsp[0].ret;
+}
+
+/* The daemon runs every operation, so its counters are the ones reported */
+int fs_stats(struct fs_stats *st)
+{
+	struct fsd_req req = { .op = FSD_STATS };
+	int ret = -1;
+
+	if (st == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&conn.lock);
+	if (fsd_call1_locked(&req) == 0) {
+		memcpy(st, conn.shm, sizeof(*st));
+		ret = 0;
+	}
+	pthread_mutex_unlock(&conn.lock);
+
+	return ret;
+}
+
+/* The calls run on the daemon's thread, not on the caller's */
+int fs_stats_thread(struct fs_stats *st)
+{
+	(void)st;
+
+	return -1;
+}
@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+/* Default number of worker threads, overridden by $FS_PARALLEL_THREADS */
+#define POOL_THREADS 4
+
+/* Upper bound for the number of worker threads */
+#define POOL_THREADS_MAX 64
+
+/*
+ * Current job of the pool. Calls are claimed one by one under lock, which is
+ * cheap since a job is only ever split in a few large pieces. generation tells
+ * the workers that a new job was posted.
+ */
+static struct {
+	pthread_once_t once;
+	/* Held by the caller whose job is running */
+	pthread_mutex_t busy;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	size_t threads;
+	uint64_t generation;
+	void (*fn)(void *arg, size_t i);
+	void *arg;
+	size_t n;
+	size_t next;
+	size_t finished;
+} pool = {
+	.once = PTHREAD_ONCE_INIT,
+	.busy = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Run the unclaimed calls of the current job. Called with pool.lock held. */
+static void pool_work(void)
+{
+	while (pool.next < pool.n) {
+		size_t i = pool.next++;
+
+		pthread_mutex_unlock(&pool.lock);
+		pool.fn(pool.arg, i);
+		pthread_mutex_lock(&pool.lock);
+
+		if (++pool.finished == pool.n) {
+			pthread_cond_broadcast(&pool.done);
+		}
+	}
+}
+
+static void *pool_worker(void *arg)
+{
+	uint64_t seen = 0;
+
+	(void)arg;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.generation == seen) {
+			pthread_cond_wait(&pool.start, &pool.lock);
+		}
+		seen = pool.generation;
+		pool_work();
+	}
+
+	return NULL;
+}
+
+/* Start the worker threads, sized by $FS_PARALLEL_THREADS */
+static void pool_init(void)
+{
+	const char *env = getenv("FS_PARALLEL_THREADS");
+	size_t threads = env ? strtoul(env, NULL, 0) : POOL_THREADS;
+
+	if (threads > POOL_THREADS_MAX) {
+		threads = POOL_THREADS_MAX;
+	}
+
+	for (size_t i = 0; i < threads; i++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, pool_worker, NULL)) {
+			break;
+		}
+		pthread_detach(thread);
+		pool.threads++;
+	}
+}
+
+size_t pool_size(void)
+{
+	pthread_once(&pool.once, pool_init);
+
+	return pool.threads;
+}
+
+void pool_run(void (*fn)(void *arg, size_t i), void *arg, size_t n)
+{
+	// run the job alone if there is no pool or it is busy with another one
+	if (pool_size() == 0 || pthread_mutex_trylock(&pool.busy)) {
+		for (size_t i = 0; i < n; i++) {
+			fn(arg, i);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.n = n;
+	pool.next = 0;
+	pool.finished = 0;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+
+	// take a share of the calls, then wait for the workers to finish theirs
+	pool_work();
+	while (pool.finished < pool.n) {
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&pool.busy);
+}
@@ -0,0 +1,32 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+/*
+ * Internal worker pool used by fs.c to split large transfers.
+ *
+ * The pool starts $FS_PARALLEL_THREADS threads (4 by default, 0 disables it)
+ * the first time it is used. It runs one job at a time; a caller that finds it
+ * busy runs its job alone instead of waiting.
+ */
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * pool_size - Get the number of worker threads
+ *
+ * Return: The number of threads of the pool, not counting callers.
+ */
+size_t pool_size(void);
+
+/**
+ * pool_run - Run a job on the pool
+ * @fn: Function to call
+ * @arg: First argument of @fn
+ * @n: Number of calls
+ *
+ * Call @fn(@arg, i) for every i from 0 to @n - 1, spread across the worker
+ * threads and the calling thread, and return once every call has returned.
+ */
+void pool_run(void (*fn)(void *arg, size_t i), void *arg, size_t n);
+
+#endif /* _POOL_H */
@@ -0,0 +1,46 @@
+#ifndef _PROBE_H
+#define _PROBE_H
+
+/*
+ * USDT static tracepoints, for perf and bpftrace. They are compiled in when
+ * <sys/sdt.h> (systemtap-sdt-dev) is available, and out otherwise. A compiled
+ * in probe is a single nop until a tracer attaches to it, and its arguments
+ * are only values already in registers or on the stack.
+ *
+ * Probes of provider "libfs", listed with e.g. `bpftrace -l 'usdt:libfs.a:*'`:
+ *   read__entry(fd, offset, count)          fs_read() and fs_pread()
+ *   read__return(fd, offset, count, ret)
+ *   write__entry(fd, offset, count)         fs_write()
+ *   write__return(fd, offset, count, ret)
+ *   block__read(block)                      every blk_read()
+ *   block__write(block)                     every blk_write()
+ *   cache__hit(block), cache__miss(block)   block cache lookups
+ *   block__alloc(entry, block)              a data block linked to a file
+ *   meta__flush(fat_blocks)                 metadata written back, with the
+ *                                           number of dirty FAT blocks
+ *
+ * Offsets of write__* are the descriptor's offset, appends land at the end of
+ * the file instead. Block numbers of block__* and cache__* are disk blocks,
+ * the one of block__alloc is a data block.
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE_SDT 1
+#endif
+#endif
+
+#ifdef PROBE_SDT
+#define PROBE1(name, a)			DTRACE_PROBE1(libfs, name, a)
+#define PROBE2(name, a, b)		DTRACE_PROBE2(libfs, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(libfs, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(libfs, name, a, b, c, d)
+#else
+#define PROBE1(name, a)			do { (void)(a); } while (0)
+#define PROBE2(name, a, b)		do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c)		do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(name, a, b, c, d)	do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+#endif /* _PROBE_H */
@@ -0,0 +1,69 @@
+#include <sched.h>
+#include <stdint.h>
+
+#include "rcu.h"
+
+/* Number of reader slots, threads beyond this share slots */
+#define RCU_SLOTS 64
+
+/*
+ * Each slot counts the readers inside a critical section, separately for the
+ * two phases. A slot is a cache line of its own so that readers of different
+ * threads do not contend.
+ */
+struct rcu_slot {
+	unsigned long count[2];
+} __attribute__((aligned(64)));
+
+static struct rcu_slot slots[RCU_SLOTS];
+
+/* Bit 0 selects the phase new readers are counted in */
+static unsigned long phase;
+
+/* Number of threads that have been given a slot */
+static unsigned long threads;
+
+/* Slot of the calling thread, -1 until its first read-side section */
+static __thread int slot = -1;
+
+int rcu_read_lock(void)
+{
+	if (slot == -1) {
+		slot = __atomic_fetch_add(&threads, 1, __ATOMIC_RELAXED) % RCU_SLOTS;
+	}
+
+	int idx = __atomic_load_n(&phase, __ATOMIC_RELAXED) & 1;
+
+	// the full barrier orders the count before any read of published data
+	__atomic_fetch_add(&slots[slot].count[idx], 1, __ATOMIC_SEQ_CST);
+
+	return slot << 1 | idx;
+}
+
+void rcu_read_unlock(int token)
+{
+	__atomic_fetch_sub(&slots[token >> 1].count[token & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+/* Flip the phase and wait for the readers counted in the old one */
+static void rcu_flip(void)
+{
+	int idx = __atomic_fetch_add(&phase, 1, __ATOMIC_SEQ_CST) & 1;
+
+	for (int i = 0; i < RCU_SLOTS; i++) {
+		while (__atomic_load_n(&slots[i].count[idx], __ATOMIC_SEQ_CST) != 0) {
+			sched_yield();
+		}
+	}
+}
+
+void rcu_synchronize(void)
+{
+	/*
+	 * A reader may have sampled the phase just before the first flip but
+	 * only be counted after it was checked, so flip twice: the second wait
+	 * catches such a reader in the phase it was actually counted in.
+	 */
+	rcu_flip();
+	rcu_flip();
+}
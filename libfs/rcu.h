@@ -0,0 +1,35 @@
+#ifndef _RCU_H
+#define _RCU_H
+
+/*
+ * Internal read-copy-update helpers used by fs.c.
+ *
+ * Readers bracket their accesses to published metadata with rcu_read_lock()
+ * and rcu_read_unlock(), which never block. A writer publishes a new version of
+ * the metadata with an atomic pointer store and calls rcu_synchronize() before
+ * freeing the old version, which waits until no reader can still be using it.
+ * Writers must be serialized by the caller.
+ */
+
+/**
+ * rcu_read_lock - Enter a read-side critical section
+ *
+ * Return: A token to pass to the matching rcu_read_unlock().
+ */
+int rcu_read_lock(void);
+
+/**
+ * rcu_read_unlock - Leave a read-side critical section
+ * @token: Value returned by the matching rcu_read_lock()
+ */
+void rcu_read_unlock(int token);
+
+/**
+ * rcu_synchronize - Wait for pre-existing readers
+ *
+ * Return once every read-side critical section that was in progress when this
+ * function was called has ended.
+ */
+void rcu_synchronize(void);
+
+#endif /* _RCU_H */
@@ -0,0 +1,113 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "record.h"
+
+/* Number of records buffered before they are written out */
+#define RECORD_BUFFER 1024
+
+static struct {
+	pthread_once_t once;
+	/* Guards buf, count and the writes to fd */
+	pthread_mutex_t lock;
+	int fd;
+	size_t count;
+	struct fs_record buf[RECORD_BUFFER];
+} record = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static __thread uint32_t local_tid;
+
+/* Write the buffered records out, with record.lock held */
+static void record_write(void)
+{
+	const char *p = (const char *)record.buf;
+	size_t left = record.count * sizeof(struct fs_record);
+
+	while (left > 0) {
+		ssize_t n = write(record.fd, p, left);
+		if (n <= 0) {
+			// stop recording rather than produce a file with a hole
+			close(record.fd);
+			__atomic_store_n(&record.fd, -1, __ATOMIC_RELAXED);
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	record.count = 0;
+}
+
+static void record_init(void)
+{
+	const char *path = getenv("FS_RECORD");
+	struct fs_record_header header = {
+		.magic = FS_RECORD_MAGIC,
+		.record_size = sizeof(struct fs_record),
+	};
+
+	if (path == NULL || *path == '\0') {
+		return;
+	}
+
+	record.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (record.fd == -1) {
+		return;
+	}
+	if (write(record.fd, &header, sizeof(header)) != sizeof(header)) {
+		close(record.fd);
+		record.fd = -1;
+		return;
+	}
+
+	atexit(record_flush);
+}
+
+int record_on(void)
+{
+	pthread_once(&record.once, record_init);
+
+	return __atomic_load_n(&record.fd, __ATOMIC_RELAXED) != -1;
+}
+
+void record_call(struct fs_record *rec)
+{
+	if (!record_on()) {
+		return;
+	}
+
+	if (local_tid == 0) {
+		local_tid = syscall(SYS_gettid);
+	}
+	rec->tid = local_tid;
+
+	pthread_mutex_lock(&record.lock);
+	if (record.fd != -1) {
+		record.buf[record.count++] = *rec;
+		if (record.count == RECORD_BUFFER) {
+			record_write();
+		}
+	}
+	pthread_mutex_unlock(&record.lock);
+}
+
+void record_flush(void)
+{
+	if (!record_on()) {
+		return;
+	}
+
+	pthread_mutex_lock(&record.lock);
+	if (record.fd != -1) {
+		record_write();
+	}
+	pthread_mutex_unlock(&record.lock);
+}
@@ -0,0 +1,35 @@
+#ifndef _RECORD_H
+#define _RECORD_H
+
+/*
+ * Recording of the public calls into the $FS_RECORD file, in the format of
+ * struct fs_record (see fs_ext.h), for apps/replay.x to play back.
+ *
+ * Records are appended in the order calls complete, so the calls of a thread
+ * stay in order. They go through a buffer shared by every thread, written out
+ * when it fills up, at fs_umount() and at exit.
+ */
+
+#include <stdint.h>
+
+#include "fs_ext.h"
+
+/**
+ * record_on - Tell whether recording is on
+ *
+ * Return: 1 if $FS_RECORD is set and its file could be created, 0 otherwise.
+ */
+int record_on(void);
+
+/**
+ * record_call - Record a call, if recording is on
+ * @rec: Call to record, its @tid is filled in
+ */
+void record_call(struct fs_record *rec);
+
+/**
+ * record_flush - Write out the buffered records
+ */
+void record_flush(void);
+
+#endif /* _RECORD_H */
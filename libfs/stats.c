@@ -0,0 +1,248 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "record.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Counters of one thread, linked in the list of live threads */
+struct thread_stats {
+	struct fs_stats st;
+	struct thread_stats *prev;
+	struct thread_stats *next;
+};
+
+static struct {
+	pthread_once_t once;
+	pthread_key_t key;
+	/* Guards threads and retired */
+	pthread_mutex_t lock;
+	struct thread_stats *threads;
+	/* Sum of the counters of exited threads */
+	struct fs_stats retired;
+	int enabled;
+} stats = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct thread_stats *local;
+
+static const char *const op_names[FS_STAT_OP_COUNT] = {
+	[FS_STAT_MOUNT] = "fs_mount",
+	[FS_STAT_UMOUNT] = "fs_umount",
+	[FS_STAT_INFO] = "fs_info",
+	[FS_STAT_STATFS] = "fs_statfs",
+	[FS_STAT_CREATE] = "fs_create",
+	[FS_STAT_DELETE] = "fs_delete",
+	[FS_STAT_LS] = "fs_ls",
+	[FS_STAT_READDIR] = "fs_readdir",
+	[FS_STAT_OPEN] = "fs_open",
+	[FS_STAT_CLOSE] = "fs_close",
+	[FS_STAT_STAT] = "fs_stat",
+	[FS_STAT_LSEEK] = "fs_lseek",
+	[FS_STAT_WRITE] = "fs_write",
+	[FS_STAT_READ] = "fs_read",
+	[FS_STAT_PREAD] = "fs_pread",
+	[FS_STAT_SUBMIT] = "fs_submit",
+	[FS_STAT_SYNC] = "fs_sync",
+	[FS_STAT_EXTENTS] = "fs_extents",
+	[FS_STAT_CHECK] = "fs_check",
+	[FS_STAT_ADVISE] = "fs_advise",
+	[FS_STAT_BLOCK_READ] = "block_read",
+	[FS_STAT_BLOCK_WRITE] = "block_write",
+};
+
+/* Add every counter of @src to @dst, both are arrays of uint64_t */
+static void stats_sum(struct fs_stats *dst, struct fs_stats *src)
+{
+	uint64_t *d = (uint64_t *)dst;
+	uint64_t *s = (uint64_t *)src;
+
+	for (size_t i = 0; i < sizeof(struct fs_stats) / sizeof(uint64_t); i++) {
+		d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+	}
+}
+
+/* Thread exit: fold the thread's counters into the retired ones */
+static void stats_retire(void *arg)
+{
+	struct thread_stats *t = arg;
+
+	pthread_mutex_lock(&stats.lock);
+	stats_sum(&stats.retired, &t->st);
+	if (t->prev) {
+		t->prev->next = t->next;
+	} else {
+		stats.threads = t->next;
+	}
+	if (t->next) {
+		t->next->prev = t->prev;
+	}
+	pthread_mutex_unlock(&stats.lock);
+
+	free(t);
+}
+
+static void stats_init(void)
+{
+	const char *env = getenv("FS_STATS");
+
+	stats.enabled = env == NULL || strcmp(env, "0") != 0;
+	pthread_key_create(&stats.key, stats_retire);
+}
+
+struct fs_stats *stats_local(void)
+{
+	if (local) {
+		return &local->st;
+	}
+
+	pthread_once(&stats.once, stats_init);
+	if (!stats.enabled) {
+		return NULL;
+	}
+
+	struct thread_stats *t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&stats.lock);
+	t->next = stats.threads;
+	if (stats.threads) {
+		stats.threads->prev = t;
+	}
+	stats.threads = t;
+	pthread_mutex_unlock(&stats.lock);
+
+	pthread_setspecific(stats.key, t);
+	local = t;
+
+	return &t->st;
+}
+
+/* Current time in nanoseconds */
+static uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t stats_start(void)
+{
+	return stats_local() || trace_on() || record_on() ? stats_now() : 0;
+}
+
+/*
+ * Histogram bucket of latency @ns. Values below 8 have a bucket each, then every
+ * power of two is split in 8 buckets, so a bucket is never wider than 1/8 of
+ * the values it holds.
+ */
+static size_t stats_bucket(uint64_t ns)
+{
+	if (ns < 8) {
+		return ns;
+	}
+
+	size_t e = 63 - __builtin_clzll(ns);
+	size_t b = (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+
+	return b < FS_STATS_BUCKETS ? b : FS_STATS_BUCKETS - 1;
+}
+
+void stats_end(int op, uint64_t start, int ret, uint64_t bytes)
+{
+	if (start == 0) {
+		return;
+	}
+
+	uint64_t end = stats_now();
+	trace_event(op, start, end, ret);
+
+	struct fs_stats *st = stats_local();
+	if (st == NULL) {
+		return;
+	}
+
+	struct fs_op_stats *o = &st->op[op];
+	stats_add(&o->calls, 1);
+	if (ret < 0) {
+		stats_add(&o->errors, 1);
+	}
+	stats_add(&o->bytes, bytes);
+	stats_add(&o->hist[stats_bucket(end - start)], 1);
+}
+
+void stats_collect(struct fs_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+
+	pthread_mutex_lock(&stats.lock);
+	stats_sum(st, &stats.retired);
+	for (struct thread_stats *t = stats.threads; t; t = t->next) {
+		stats_sum(st, &t->st);
+	}
+	pthread_mutex_unlock(&stats.lock);
+}
+
+void stats_thread(struct fs_stats *st)
+{
+	struct fs_stats *local_st = stats_local();
+
+	if (local_st) {
+		memcpy(st, local_st, sizeof(*st));
+	} else {
+		memset(st, 0, sizeof(*st));
+	}
+}
+
+const char *fs_stats_name(int op)
+{
+	if (op < 0 || op >= FS_STAT_OP_COUNT) {
+		return NULL;
+	}
+
+	return op_names[op];
+}
+
+uint64_t fs_stats_bucket_ns(size_t bucket)
+{
+	if (bucket < 8) {
+		return bucket;
+	}
+
+	return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+uint64_t fs_stats_percentile(const struct fs_op_stats *op, double q)
+{
+	uint64_t total = 0, seen = 0;
+
+	for (size_t b = 0; b < FS_STATS_BUCKETS; b++) {
+		total += op->hist[b];
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	// rank of the value to find, counting from 1
+	uint64_t rank = (uint64_t)(q * total + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	for (size_t b = 0; b < FS_STATS_BUCKETS; b++) {
+		seen += op->hist[b];
+		if (seen >= rank) {
+			return fs_stats_bucket_ns(b);
+		}
+	}
+
+	return fs_stats_bucket_ns(FS_STATS_BUCKETS - 1);
+}
@@ -0,0 +1,78 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+/*
+ * Internal statistics collection behind fs_stats().
+ *
+ * Every thread updates its own struct fs_stats, registered on its first
+ * update, so counting never contends with other threads. stats_collect() sums
+ * them, along with what exited threads left behind. Setting $FS_STATS to 0
+ * turns collection off.
+ *
+ * The histogram helpers of fs_ext.h live here too, so that the fsd client stub
+ * can link them without the collection.
+ */
+
+#include <stdint.h>
+
+#include "fs_ext.h"
+
+/**
+ * stats_local - Get the counters of the calling thread
+ *
+ * Return: NULL if collection is turned off, otherwise the calling thread's
+ * counters, which only it may update (see stats_add()).
+ */
+struct fs_stats *stats_local(void);
+
+/**
+ * stats_add - Add to one of the calling thread's counters
+ * @counter: Counter of the struct returned by stats_local()
+ * @n: Amount to add
+ *
+ * Only the owning thread writes its counters, so no atomic read-modify-write is
+ * needed, but readers summing them concurrently must see whole values.
+ */
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* Add @n to counter @field of the calling thread, if collection is on */
+#define STATS_ADD(field, n)						\
+do {									\
+	struct fs_stats *_st = stats_local();	\
+	if (_st)								\
+		stats_add(&_st->field, (n));		\
+} while (0)
+
+/**
+ * stats_start - Start timing a call
+ *
+ * Return: A timestamp to pass to stats_end(), 0 if collection, tracing (see
+ * trace.h) and recording (see record.h) are all turned off.
+ */
+uint64_t stats_start(void);
+
+/**
+ * stats_end - Account for a call, and record it in the trace
+ * @op: Operation, one of the FS_STAT_* values
+ * @start: Value returned by stats_start() when the call started
+ * @ret: Return value of the call, negative for an error
+ * @bytes: Number of bytes the call transferred
+ */
+void stats_end(int op, uint64_t start, int ret, uint64_t bytes);
+
+/**
+ * stats_collect - Sum the counters of every thread
+ * @st: Filled with the sum
+ */
+void stats_collect(struct fs_stats *st);
+
+/**
+ * stats_thread - Get the counters of the calling thread
+ * @st: Filled with the counters, all 0 if collection is turned off
+ */
+void stats_thread(struct fs_stats *st);
+
+#endif /* _STATS_H */
@@ -0,0 +1,241 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "fs_ext.h"
+#include "trace.h"
+
+#define TRACE_EVENTS 16384
+#define TRACE_EVENTS_MAX (1 << 24)
+
+/* One call, a Chrome trace complete event */
+struct trace_ev {
+	uint64_t start;
+	uint64_t end;
+	uint32_t tid;
+	int32_t op;
+	int64_t ret;
+};
+
+/* Events of one thread, linked in the list of every ring */
+struct trace_ring {
+	struct trace_ring *next;
+	/* Cleared when the owning thread exits, the ring can then be reused */
+	int owned;
+	/* Number of events ever recorded, the last ones are in ev */
+	uint64_t head;
+	struct trace_ev ev[];
+};
+
+static struct {
+	pthread_once_t once;
+	pthread_key_t key;
+	/* Guards rings, owned and dumps */
+	pthread_mutex_t lock;
+	struct trace_ring *rings;
+	/* Events per ring, a power of two */
+	size_t size;
+	const char *path;
+} trace = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct trace_ring *local;
+static __thread uint32_t local_tid;
+
+/* Thread exit: hand the ring over to the next thread */
+static void trace_release(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	pthread_mutex_lock(&trace.lock);
+	ring->owned = 0;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+static void trace_init(void)
+{
+	const char *env = getenv("FS_TRACE");
+	const char *events = getenv("FS_TRACE_EVENTS");
+	size_t want = TRACE_EVENTS;
+
+	if (env == NULL || *env == '\0') {
+		return;
+	}
+
+	if (events) {
+		want = strtoul(events, NULL, 0);
+		if (want == 0 || want > TRACE_EVENTS_MAX) {
+			want = TRACE_EVENTS;
+		}
+	}
+	trace.size = 1;
+	while (trace.size < want) {
+		trace.size *= 2;
+	}
+
+	pthread_key_create(&trace.key, trace_release);
+	trace.path = env;
+}
+
+int trace_on(void)
+{
+	pthread_once(&trace.once, trace_init);
+
+	return trace.path != NULL;
+}
+
+/* Ring of the calling thread, a released one if any, NULL if out of memory */
+static struct trace_ring *trace_local(void)
+{
+	struct trace_ring *ring;
+
+	if (local) {
+		return local;
+	}
+
+	pthread_mutex_lock(&trace.lock);
+	for (ring = trace.rings; ring; ring = ring->next) {
+		if (!ring->owned) {
+			break;
+		}
+	}
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(*ring) + trace.size * sizeof(struct trace_ev));
+		if (ring) {
+			ring->next = trace.rings;
+			trace.rings = ring;
+		}
+	}
+	if (ring) {
+		ring->owned = 1;
+	}
+	pthread_mutex_unlock(&trace.lock);
+
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	pthread_setspecific(trace.key, ring);
+	local = ring;
+	local_tid = syscall(SYS_gettid);
+
+	return ring;
+}
+
+void trace_event(int op, uint64_t start, uint64_t end, int ret)
+{
+	struct trace_ring *ring;
+
+	if (!trace_on() || (ring = trace_local()) == NULL) {
+		return;
+	}
+
+	uint64_t head = ring->head;
+	struct trace_ev *ev = &ring->ev[head & (trace.size - 1)];
+
+	__atomic_store_n(&ev->start, start, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->end, end, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->tid, local_tid, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->op, op, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->ret, ret, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Print the events of @ring to @f, starting with a comma unless @first */
+static void trace_ring_dump(FILE *f, struct trace_ring *ring, struct trace_ev *copy, int *first)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t lo = head > trace.size ? head - trace.size : 0;
+
+	for (uint64_t i = lo; i < head; i++) {
+		struct trace_ev *ev = &ring->ev[i & (trace.size - 1)];
+		struct trace_ev *c = &copy[i - lo];
+
+		c->start = __atomic_load_n(&ev->start, __ATOMIC_RELAXED);
+		c->end = __atomic_load_n(&ev->end, __ATOMIC_RELAXED);
+		c->tid = __atomic_load_n(&ev->tid, __ATOMIC_RELAXED);
+		c->op = __atomic_load_n(&ev->op, __ATOMIC_RELAXED);
+		c->ret = __atomic_load_n(&ev->ret, __ATOMIC_RELAXED);
+	}
+
+	// the owner kept recording, drop the events it may have overwritten meanwhile
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint64_t valid = now >= trace.size ? now - trace.size + 1 : 0;
+	if (ring == local) {
+		valid = lo;
+	}
+
+	for (uint64_t i = lo > valid ? lo : valid; i < head; i++) {
+		struct trace_ev *c = &copy[i - lo];
+		const char *name = fs_stats_name(c->op);
+
+		if (name == NULL) {
+			continue;
+		}
+		fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			"\"ts\":%" PRIu64 ".%03" PRIu64 ",\"dur\":%" PRIu64 ".%03" PRIu64 ","
+			"\"pid\":%d,\"tid\":%" PRIu32 ",\"args\":{\"ret\":%" PRId64 "}}",
+			*first ? "" : ",", name,
+			c->op >= FS_STAT_BLOCK_READ ? "block" : "fs",
+			c->start / 1000, c->start % 1000,
+			(c->end - c->start) / 1000, (c->end - c->start) % 1000,
+			(int)getpid(), c->tid, c->ret);
+		*first = 0;
+	}
+}
+
+int fs_trace_dump(const char *path)
+{
+	if (!trace_on()) {
+		return -1;
+	}
+	if (path == NULL) {
+		path = trace.path;
+	}
+
+	struct trace_ev *copy = malloc(trace.size * sizeof(struct trace_ev));
+	FILE *f = fopen(path, "w");
+	int first = 1;
+	int ret = 0;
+
+	if (copy == NULL || f == NULL) {
+		free(copy);
+		if (f) {
+			fclose(f);
+		}
+		return -1;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	pthread_mutex_lock(&trace.lock);
+	for (struct trace_ring *ring = trace.rings; ring; ring = ring->next) {
+		trace_ring_dump(f, ring, copy, &first);
+	}
+	pthread_mutex_unlock(&trace.lock);
+	fprintf(f, "\n]}\n");
+
+	if (ferror(f)) {
+		ret = -1;
+	}
+	if (fclose(f) == EOF) {
+		ret = -1;
+	}
+	free(copy);
+
+	return ret;
+}
+
+void trace_flush(void)
+{
+	if (trace_on()) {
+		fs_trace_dump(NULL);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Timeline of the calls counted by stats.h, exported by fs_trace_dump().
+ *
+ * Tracing is on when $FS_TRACE names the file to dump to. Every thread records
+ * its calls into its own ring of $FS_TRACE_EVENTS events (16384 by default,
+ * rounded up to a power of two), overwriting the oldest ones, so memory stays
+ * bounded by the number of threads alive at once. A ring is recycled by the
+ * next thread once its owner exits. Only the owner writes a ring, and a dump
+ * drops the events overwritten while it copied them, so recording never
+ * takes a lock.
+ */
+
+#include <stdint.h>
+
+/**
+ * trace_on - Tell whether tracing is on
+ *
+ * Return: 1 if $FS_TRACE is set, 0 otherwise.
+ */
+int trace_on(void);
+
+/**
+ * trace_event - Record a call in the calling thread's ring
+ * @op: Operation, one of the FS_STAT_* values
+ * @start: Time the call started, in nanoseconds
+ * @end: Time the call ended, in nanoseconds
+ * @ret: Return value of the call
+ */
+void trace_event(int op, uint64_t start, uint64_t end, int ret);
+
+/**
+ * trace_flush - Dump the recorded events to $FS_TRACE, if tracing is on
+ */
+void trace_flush(void);
+
+#endif /* _TRACE_H */